@@ -4,28 +4,185 @@
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL 1
+#endif
 
 struct globalArgs_t {
     int input;                  /* -i input */
     char *inFileName;
     FILE *inFile;
     int verbose;                /* -v option */
+    int scalar;                 /* -S option */
+    int xray;                   /* -x option */
+    char *lifeFileName;         /* -l option */
+    FILE *lifeFile;
+    char *outFileName;          /* -o option */
+    FILE *outFile;
+    char *checkFileName;        /* -c option */
+    long checkInterval;         /* -C option */
+    int resume;                 /* --resume option */
+    int format;                 /* -f option */
+    char *serveName;            /* -s option */
+    char *queryName;            /* -q option */
+    int workers;                /* -w option */
     int help;                   /* -h option */
 } globalArgs;
 
-static const char *optString = "i:hv?";
+static const char *optString = "i:l:o:c:C:f:s:q:w:hvSx?";
+
+static const struct option longOpts[] = {
+    { "resume", no_argument, NULL, 'R' },
+    { NULL, 0, NULL, 0 }
+};
+
+/* Output formats (-f) */
+#define FORMAT_MATRIX 0         /* 32x32 table per position */
+#define FORMAT_COO 1            /* "game ply i j kind" line per contact */
+#define FORMAT_BIN 2            /* COO_RECORD-byte record per contact */
+
+/* Kinds of contact in the COO formats */
+#define KIND_DCM 0
+#define KIND_TCM 1
+#define KIND_XDCM 2
+#define KIND_XTCM 3
+
+/* Binary COO record: game (uint32), ply (uint32), i, j, kind and a zero
+ * byte, integers little endian */
+#define COO_RECORD 12
 
 /* Headers */
 /** Prints help message */
 void usage(char*);
 void printBoard_num(int**);
 void printBoard_txt(int**);
-void printCM(int**);
+void printCM(FILE*,int**);
 int **allocBoard(void);
 void restartBoard(int**);
+void clearBoard(int**);
 /* Allocates and initialises to 0 a 8x8 matrix. Returns the pointer */
 int **allocCM(void);
-void calcCM(int**,int**,int**,int**,int[],int**,int[]);
+void clearCM(int**);
+void calcCM(int**,int**,int**,int**,int**,int[],int**,int[]);
+
+/* Position in the compact layout used by the batch CM kernel. Squares are
+ * numbered i*8+j as in the int** boards (row 0 is the 8th rank). */
+struct position_t {
+    unsigned char board[64];    /* Piece on each square, 0 if empty */
+    unsigned char passed[64];   /* Pawn that can be taken en passant here */
+    unsigned char type[33];     /* Piece each id moves as (promoted pawns) */
+    signed char square[33];     /* Square of each piece, -1 if captured */
+};
+
+/* Packed contact matrix: bit q-1 of row[p-1] is cm[p][q] */
+struct packedCM_t {
+    uint32_t row[32];
+};
+
+/* Where a position is in the input */
+struct plyInfo_t {
+    long game;                  /* Game number, from 1 */
+    int ply;                    /* Position within the game, from 0 */
+    uint32_t moved;             /* Pieces moved to get here (bit id-1) */
+    uint32_t captured;          /* Pieces captured to get here */
+};
+
+/* Contacts alive in the current game: only the last CM and the ply each live
+ * contact appeared are kept */
+struct lifetimes_t {
+    long game;
+    int ply;
+    struct packedCM_t last;
+    short born[32][32];
+};
+
+/* Running totals of a run */
+struct runStats_t {
+    long games;
+    long positions;
+    long skipped;               /* Lines that were not positions */
+    long long dcm;              /* Contacts between pieces of the same colour */
+    long long tcm;              /* Contacts between colours */
+};
+
+/* State saved between games so that a run can be resumed */
+struct checkpoint_t {
+    long input;                 /* Input offset of the next game */
+    long output;                /* Size of the CM output */
+    long lifetimes;             /* Size of the -l output, -1 if none */
+    int xray;                   /* -x given */
+    int format;                 /* -f given */
+    struct runStats_t stats;
+};
+
+/* Number of positions handed to the kernel at once */
+#define CM_BATCH 64
+
+/* Daemon mode: every request line gets a frame of FRAME_HEADER bytes, the
+ * status, the FRAME_* flags and the length of the payload (uint16 little
+ * endian), then the payload. Packed CMs are 32 uint32 rows (bit q-1 of row
+ * p-1 is cm[p][q], little endian), sparse ones 3 bytes per contact: i, j and
+ * the kind of the COO formats. */
+#define FRAME_HEADER 4
+#define FRAME_OK 0
+#define FRAME_BAD 1             /* The line was not a position */
+#define FRAME_SPARSE 1          /* Flag: sparse payload instead of packed */
+#define FRAME_XRAY 2            /* Flag: the x-ray CM follows the CM */
+/* Longest request line */
+#define REQUEST_LINE 4096
+
+/* Parses the board, side and en passant fields of a FEN/EPD line. Pieces get
+ * the ids of restartBoard, promoted pieces the id of a missing pawn.
+ * Returns 0 on success. */
+int parseFEN(const char*,struct position_t*);
+/* Reads a FEN/EPD line as the position one move after prev, keeping the ids
+ * of the pieces. Returns 0 and the pieces that moved and were captured (bit
+ * id-1), or -1 if no single move leads there. */
+int replayFEN(const char*,const struct position_t*,struct position_t*,uint32_t*,uint32_t*);
+/* Copies a position into the int** representation used by calcCM */
+void unpackPosition(const struct position_t*,int**,int[],int**);
+void unpackCM(const struct packedCM_t*,int**);
+void packCM(int**,struct packedCM_t*);
+/* Compares the CM of a ply with the previous one and writes the contacts
+ * that ended to the file */
+void trackLifetimes(struct lifetimes_t*,const struct packedCM_t*,const struct plyInfo_t*,FILE*);
+/* Writes the contacts still alive when the game ends */
+void endLifetimes(struct lifetimes_t*,FILE*);
+/* Writes the CM (and x-ray CM if not NULL) of a position in the -f format */
+void writeCM(FILE*,int,const struct packedCM_t*,const struct packedCM_t*,const struct plyInfo_t*,int**);
+/* Adds the contacts of a CM to the totals */
+void countContacts(struct runStats_t*,const struct packedCM_t*);
+/* Flushes an output to disk and returns its size */
+long syncOutput(FILE*);
+/* Opens an output for writing. On a resumed run it keeps the first size
+ * bytes written before instead (size >= 0). */
+FILE *openOutput(const char*,long);
+/* Writes the checkpoint file atomically. Returns 0 on success. */
+int writeCheckpoint(const char*,const struct checkpoint_t*);
+int readCheckpoint(const char*,struct checkpoint_t*);
+/* Selects the AVX2 or the portable kernel for calcCM_batch */
+void initCMKernel(void);
+/* Calculates the contact matrices of n independent positions, and their
+ * x-ray matrices unless the second array is NULL */
+void calcCM_batch(const struct position_t*,struct packedCM_t*,struct packedCM_t*,int);
+/* Answers FEN/EPD lines on a Unix socket with a pool of workers, until
+ * SIGINT or SIGTERM */
+void serveCM(const char*,int);
+/* Sends the positions of the input one at a time to a server and writes
+ * the CMs it answers, then prints the latencies */
+void queryCM(const char*,FILE*);
 
 /* Pieces */
 const char *pText[] = {
@@ -47,13 +204,26 @@ int main ( int argc, char *argv[] )
     globalArgs.inFileName = NULL;     /* Output file name */
     globalArgs.inFile = stdout;       /* Output FILE handle */
     globalArgs.verbose = 0;           /* Prints heaps of stuff */
+    globalArgs.scalar = 0;            /* Portable CM kernel even if AVX2 is there */
+    globalArgs.xray = 0;              /* Prints the x-ray CM too */
+    globalArgs.lifeFileName = NULL;   /* Contact lifetimes file name */
+    globalArgs.lifeFile = NULL;       /* Contact lifetimes FILE handle */
+    globalArgs.outFileName = NULL;    /* CM output file name */
+    globalArgs.outFile = stdout;      /* CM output FILE handle */
+    globalArgs.checkFileName = NULL;  /* Checkpoint file name */
+    globalArgs.checkInterval = 1000;  /* Games between checkpoints */
+    globalArgs.resume = 0;            /* Continues from the checkpoint */
+    globalArgs.format = FORMAT_MATRIX;/* Output format */
+    globalArgs.serveName = NULL;      /* Socket served in daemon mode */
+    globalArgs.queryName = NULL;      /* Socket of the server to query */
+    globalArgs.workers = 0;           /* Daemon workers, 0 for one per CPU */
     
     int index;
     
     opterr = 0;
     
     int c;
-    while ((c = getopt (argc, argv, optString)) != -1) {
+    while ((c = getopt_long (argc, argv, optString, longOpts, NULL)) != -1) {
         char *ptr = NULL;
         switch (c) {
             case 'i':
@@ -62,12 +232,64 @@ int main ( int argc, char *argv[] )
             case 'v':
                 globalArgs.verbose = 1;
                 break;
+            case 'S':
+                globalArgs.scalar = 1;
+                break;
+            case 'x':
+                globalArgs.xray = 1;
+                break;
+            case 'l':
+                globalArgs.lifeFileName = optarg;
+                break;
+            case 'o':
+                globalArgs.outFileName = optarg;
+                break;
+            case 'c':
+                globalArgs.checkFileName = optarg;
+                break;
+            case 'C':
+                globalArgs.checkInterval = strtol( optarg, &ptr, 0);
+                if ( *ptr || globalArgs.checkInterval <= 0 ) {
+                    fprintf(stderr, "Argument for option -C has to be a positive integer\n");
+                    exit(EXIT_FAILURE);
+                }
+                ptr = NULL;
+                break;
+            case 'R':
+                globalArgs.resume = 1;
+                break;
+            case 's':
+                globalArgs.serveName = optarg;
+                break;
+            case 'q':
+                globalArgs.queryName = optarg;
+                break;
+            case 'w':
+                globalArgs.workers = strtol( optarg, &ptr, 0);
+                if ( *ptr || globalArgs.workers <= 0 ) {
+                    fprintf(stderr, "Argument for option -w has to be a positive integer\n");
+                    exit(EXIT_FAILURE);
+                }
+                ptr = NULL;
+                break;
+            case 'f':
+                if (strcmp(optarg, "matrix") == 0) globalArgs.format = FORMAT_MATRIX;
+                else if (strcmp(optarg, "coo") == 0) globalArgs.format = FORMAT_COO;
+                else if (strcmp(optarg, "bin") == 0) globalArgs.format = FORMAT_BIN;
+                else {
+                    fprintf(stderr, "Argument for option -f has to be matrix, coo or bin\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'h':
                 usage(argv[0]);
                 exit(EXIT_SUCCESS);
             case '?':
-                if (optopt == '1')
+                if (optopt == 'i' || optopt == 'l' || optopt == 'o' || optopt == 'c' || optopt == 'f' ||
+                    optopt == 's' || optopt == 'q')
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+                else if (optopt == 'C' || optopt == 'w')
+                    fprintf(stderr, "Option -%c requires an integer.\n", optopt);
                 else if (isprint (optopt))
                     fprintf(stderr, "Unknown option '-%c'.\n", optopt);
                 else
@@ -85,6 +307,19 @@ int main ( int argc, char *argv[] )
         exit(EXIT_FAILURE);
     }
 
+    if (globalArgs.serveName) {
+        if (globalArgs.inFileName || globalArgs.queryName || globalArgs.outFileName ||
+            globalArgs.lifeFileName || globalArgs.checkFileName) {
+            fprintf(stderr, "-s serves the CMs on a socket, without -i, -q, -o, -l or -c\n");
+            exit(EXIT_FAILURE);
+        }
+        serveCM(globalArgs.serveName, globalArgs.workers);
+    }
+    if (globalArgs.queryName && (globalArgs.lifeFileName || globalArgs.checkFileName)) {
+        fprintf(stderr, "-q only writes the CMs, without -l or -c\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (globalArgs.inFileName == NULL) {
         fprintf(stderr, "No input file specified in the -i flag. See -h for help.\n");
         exit(EXIT_FAILURE);
@@ -96,6 +331,49 @@ int main ( int argc, char *argv[] )
         fprintf(stderr, "Could not open %s for reading\n", globalArgs.inFileName);
         exit(EXIT_FAILURE);
     }
+
+    /* Running totals, and where a resumed run starts */
+    struct runStats_t stats;
+    struct checkpoint_t resumeAt;
+    memset(&stats, 0, sizeof(stats));
+    resumeAt.input = resumeAt.output = resumeAt.lifetimes = -1;
+    if (globalArgs.checkFileName && !globalArgs.outFileName) {
+        fprintf(stderr, "Checkpoints need the CMs in a file. Use -o.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (globalArgs.resume) {
+        if (!globalArgs.checkFileName) {
+            fprintf(stderr, "--resume needs the checkpoint file given with -c\n");
+            exit(EXIT_FAILURE);
+        }
+        if (readCheckpoint(globalArgs.checkFileName, &resumeAt) != 0) {
+            fprintf(stderr, "Could not read a checkpoint from %s\n", globalArgs.checkFileName);
+            exit(EXIT_FAILURE);
+        }
+        if (resumeAt.xray != globalArgs.xray || resumeAt.format != globalArgs.format ||
+            (resumeAt.lifetimes >= 0) != (globalArgs.lifeFileName != NULL)) {
+            fprintf(stderr, "The checkpoint in %s was written with other -x/-f/-l options\n", globalArgs.checkFileName);
+            exit(EXIT_FAILURE);
+        }
+        if (fseek(inputF, resumeAt.input, SEEK_SET) != 0) {
+            fprintf(stderr, "Could not seek %s to byte %ld\n", globalArgs.inFileName, resumeAt.input);
+            exit(EXIT_FAILURE);
+        }
+        stats = resumeAt.stats;
+        if (globalArgs.verbose) {
+            fprintf(stderr, "Resuming after game %ld at byte %ld\n", stats.games, resumeAt.input);
+        }
+    }
+    if (globalArgs.outFileName) {
+        globalArgs.outFile = openOutput(globalArgs.outFileName, resumeAt.output);
+    }
+    if (globalArgs.lifeFileName) {
+        globalArgs.lifeFile = openOutput(globalArgs.lifeFileName, resumeAt.lifetimes);
+    }
+    if (globalArgs.queryName) {
+        queryCM(globalArgs.queryName, inputF);
+        exit(EXIT_SUCCESS);
+    }
     
     /*********************/
     /* Declare variables */
@@ -106,9 +384,9 @@ int main ( int argc, char *argv[] )
     board = allocBoard();
     restartBoard(board);
 
-    int promotedPawns[32];
+    int promotedPawns[33];
     int i;
-    for (i = 0; i < 32; i++) {
+    for (i = 0; i < 33; i++) {
         promotedPawns[i] = 0;
     }
 
@@ -120,10 +398,6 @@ int main ( int argc, char *argv[] )
     // blackLeft, blackKing, blackRight, whiteLeft, whiteKing, whiteRight
     int Castling[6] = {0, 0, 0, 0, 0, 0};
 
-    printBoard_num(board);
-    // fprintf(stdout, "\n");
-    // printBoard_txt(board);
-
     /* Alloc and init the matrices of accessibility */
     int **wAccessible;
     int **bAccessible;
@@ -132,26 +406,135 @@ int main ( int argc, char *argv[] )
 
     int **cm;
     cm = allocCM();
-    calcCM(cm, bAccessible, wAccessible, board, promotedPawns, passedPawns, Castling);
-    printCM(cm);
+    int **xcm = NULL;
+    if (globalArgs.xray) {
+        xcm = allocCM();
+    }
 
-    // NOTES FOR MOVES
-    // Remember to update the promotedPawns if a pawn is promoted. Choose the numbers
-    // corresponding to the appropriate colour, and any of the sides.
-    // Also, remember to upgrade the Castling array with values of 1 when castles or
-    // king move. Also when Castling!
-    // Last, remember to tag the passedPawns when pawns move long :) and then clean it
-    // in the next turn resetting to 0
+    /* Lifetimes of the contacts, written with -l */
+    struct lifetimes_t lifetimes;
+    lifetimes.game = 0;
+
+    /* Consecutive lines are replayed as the moves of a game, so the pieces
+     * keep their ids (promotions, en passant and castling included). A blank
+     * or tag line, or a position no single move leads to, starts a new game.
+     * Positions are collected in batches and sent to the kernel together.
+     * With -v each position goes through calcCM instead, which explains the
+     * contacts it finds. */
+    initCMKernel();
+    struct position_t *batch;
+    struct plyInfo_t *batchInfo;
+    struct packedCM_t *batchCM;
+    struct packedCM_t *batchXCM = NULL;
+    if (( batch = malloc( CM_BATCH*sizeof( struct position_t ) )) == NULL ||
+        ( batchInfo = malloc( CM_BATCH*sizeof( struct plyInfo_t ) )) == NULL ||
+        ( batchCM = malloc( CM_BATCH*sizeof( struct packedCM_t ) )) == NULL ||
+        ( xcm && ( batchXCM = malloc( CM_BATCH*sizeof( struct packedCM_t ) )) == NULL )) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    int pending = 0;
+    struct position_t last;
+    int inGame = 0;
+    int ply = 0;
+    long checkedGames = stats.games;
 
     char *line = NULL;
     size_t len = 0;
     ssize_t read;
-    while ((read = getline(&line, &len, inputF)) != -1) {
+    int eof = 0;
+    while (!eof) {
+        int boundary = 0;
+        if ((read = getline(&line, &len, inputF)) == -1) {
+            eof = 1;
+        }
         //if (strcmp(line, "[") == 0) {
-        if (strncmp(line, "[", 1) == 0) {
-            continue;
+        else if (strncmp(line, "[", 1) == 0 || strspn(line, " \t\r\n") == (size_t) read) {
+            inGame = 0;
+            boundary = 1;
+        }
+        else {
+            struct plyInfo_t *info = &batchInfo[pending];
+            if (inGame && replayFEN(line, &last, &batch[pending], &info->moved, &info->captured) == 0) {
+                ply++;
+            }
+            else if (parseFEN(line, &batch[pending]) == 0) {
+                stats.games++;
+                ply = 0;
+                info->moved = info->captured = 0;
+            }
+            else {
+                fprintf(stderr, "WARNING: could not parse position: %s", line);
+                stats.skipped++;
+                inGame = 0;
+                continue;
+            }
+            info->game = stats.games;
+            info->ply = ply;
+            last = batch[pending];
+            inGame = 1;
+            pending++;
         }
-        fprintf(stdout, "%s", line);
+
+        /* Checkpoints are taken between games, once everything before is
+         * written out */
+        int checkpoint = boundary && globalArgs.checkFileName &&
+                         stats.games - checkedGames >= globalArgs.checkInterval;
+        if (pending == CM_BATCH || ((eof || checkpoint) && pending > 0)) {
+            int n;
+            if (globalArgs.verbose) {
+                for (n = 0; n < pending; n++) {
+                    unpackPosition(&batch[n], board, promotedPawns, passedPawns);
+                    clearCM(cm);
+                    if (xcm) clearCM(xcm);
+                    clearBoard(bAccessible);
+                    clearBoard(wAccessible);
+                    printBoard_num(board);
+                    calcCM(cm, xcm, bAccessible, wAccessible, board, promotedPawns, passedPawns, Castling);
+                    packCM(cm, &batchCM[n]);
+                    if (xcm) packCM(xcm, &batchXCM[n]);
+                    writeCM(globalArgs.outFile, globalArgs.format, &batchCM[n],
+                            batchXCM ? &batchXCM[n] : NULL, &batchInfo[n], cm);
+                }
+            }
+            else {
+                calcCM_batch(batch, batchCM, batchXCM, pending);
+                for (n = 0; n < pending; n++) {
+                    writeCM(globalArgs.outFile, globalArgs.format, &batchCM[n],
+                            batchXCM ? &batchXCM[n] : NULL, &batchInfo[n], cm);
+                }
+            }
+            for (n = 0; n < pending; n++) {
+                countContacts(&stats, &batchCM[n]);
+                if (globalArgs.lifeFile) {
+                    trackLifetimes(&lifetimes, &batchCM[n], &batchInfo[n], globalArgs.lifeFile);
+                }
+            }
+            pending = 0;
+        }
+        if (checkpoint) {
+            struct checkpoint_t cp;
+            if (globalArgs.lifeFile) {
+                endLifetimes(&lifetimes, globalArgs.lifeFile);
+            }
+            cp.input = ftell(inputF);
+            cp.output = syncOutput(globalArgs.outFile);
+            cp.lifetimes = globalArgs.lifeFile ? syncOutput(globalArgs.lifeFile) : -1;
+            cp.xray = globalArgs.xray;
+            cp.format = globalArgs.format;
+            cp.stats = stats;
+            if (writeCheckpoint(globalArgs.checkFileName, &cp) != 0) {
+                fprintf(stderr, "WARNING: could not write checkpoint %s\n", globalArgs.checkFileName);
+            }
+            checkedGames = stats.games;
+        }
+    }
+    if (globalArgs.lifeFile) {
+        endLifetimes(&lifetimes, globalArgs.lifeFile);
+        fclose(globalArgs.lifeFile);
+    }
+    if (globalArgs.outFileName) {
+        fclose(globalArgs.outFile);
     }
 
     free(line);
@@ -160,7 +543,13 @@ int main ( int argc, char *argv[] )
     // TODO free the allocated memroy
 
     clock_t end = clock();
-    //fprintf(stderr, "Time elapsed = %d (%.3f secs)\n", (int) (end - start), (float) (end - start) / CLOCKS_PER_SEC);
+    fprintf(stderr, "Games = %ld\n", stats.games);
+    fprintf(stderr, "Positions = %ld (%ld lines skipped)\n", stats.positions, stats.skipped);
+    if (stats.positions) {
+        fprintf(stderr, "Contacts per position = %.2f DCM, %.2f TCM\n",
+                (double) stats.dcm / stats.positions, (double) stats.tcm / stats.positions);
+    }
+    fprintf(stderr, "Time elapsed = %d (%.3f secs)\n", (int) (end - start), (float) (end - start) / CLOCKS_PER_SEC);
 
 }
 
@@ -196,18 +585,31 @@ int **allocCM(void) {
 
     int i;
     for (i = 0; i < 33; i++) {
-        if (( cm[i] = malloc( 32*sizeof( int) )) == NULL ) {
+        if (( cm[i] = malloc( 33*sizeof( int) )) == NULL ) {
             fprintf(stderr, "ERROR: out of memory\n");
             exit(EXIT_FAILURE);
         }
     }
-    int j;
+    clearCM(cm);
+    return cm;
+}
+
+void clearCM(int **cm) {
+    int i, j;
     for (i = 0; i < 33; i++) {
         for (j = 0; j < 33; j++) {
             cm[i][j] = 0;
         }
     }
-    return cm;
+}
+
+void clearBoard(int **b) {
+    int i, j;
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 8; j++) {
+            b[i][j] = 0;
+        }
+    }
 }
 
 void restartBoard(int **b) {
@@ -234,18 +636,48 @@ void usage(char *pname) {
     fprintf(stderr, "%s -i <file.pgn> [OPTIONS]\n", pname);
     fprintf(stderr, "  -i       PGN input file to parse\n"
                     "  -v       Prints heaps of useless stuff. Mainly for debugging\n"
+                    "  -S       Uses the portable CM kernel even if the CPU has AVX2\n"
+                    "  -x       Prints the x-ray CM (contacts through one piece) after each CM\n"
+                    "  -l FILE  Writes the lifetime of every contact of each game to FILE\n"
+                    "  -o FILE  Writes the CMs to FILE instead of stdout\n"
+                    "  -f FMT   CM output format: matrix (default), coo or bin\n"
+                    "  -c FILE  Saves a checkpoint to FILE every few games (needs -o)\n"
+                    "  -C N     Games between checkpoints (default 1000)\n"
+                    "  --resume Continues from the checkpoint given with -c\n"
+                    "  -s SOCK  Serves CMs on the Unix socket SOCK instead (no -i),\n"
+                    "           packed with -f matrix, sparse with -f coo or bin\n"
+                    "  -w N     Workers of -s (default one per CPU)\n"
+                    "  -q SOCK  Gets the CMs of the -i positions from the server on SOCK\n"
+                    "           and prints the latencies\n"
                     "  -h       Prints (this) help message\n");
 }
 
+/*
+ * Follows a ray of piece p past the piece in i:j and records an x-ray
+ * contact with the next piece on it.
+ */
+static void xrayContact(int **xcm, int p, int **b, int i, int j, int di, int dj) {
+    for (i += di, j += dj; i >= 0 && i < 8 && j >= 0 && j < 8; i += di, j += dj) {
+        if (b[i][j] != 0) {
+            if (globalArgs.verbose) fprintf(stdout, " X-ray contact with %d(%s) in %d:%d\n", b[i][j], pText[b[i][j]], i, j);
+            xcm[p][b[i][j]] = 1;
+            return;
+        }
+    }
+}
+
 /*
  * Calculates the contact matrix between each pair of pieces.
  * The values between pairs of the same colour indicate "protection", while
  * values between pairs of different colour indicate "threat".
  * A value of 1 indicates "protection"/"threat" and a value of 0 indicates
  * no "protection"/"threat".
+ * If xcm is not NULL it gets the x-ray contacts of the rooks, bishops and
+ * queens: the pieces right behind the first one on each ray (batteries,
+ * pins and discovered attacks).
  */
 
-void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[], int **pPawns, int Castling[]) {
+void calcCM(int **cm, int **xcm, int **bAccessible, int **wAccessible, int **b, int sPawns[], int **pPawns, int Castling[]) {
     int bKing[2] = {-1, -1};
     int wKing[2] = {-1, -1};
     int p, p2;
@@ -273,6 +705,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[i][n]] = 1;
                         else 
                             cm[p][b[i][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, i, n, 0, -1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -290,6 +723,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[i][n]] = 1;
                         else 
                             cm[p][b[i][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, i, n, 0, 1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -307,6 +741,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[n][j]] = 1;
                         else 
                             cm[p][b[n][j]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, n, j, -1, 0);
                         break;
                     } else {
                         // Space accessible but empty
@@ -324,6 +759,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[n][j]] = 1;
                         else 
                             cm[p][b[n][j]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, n, j, 1, 0);
                         break;
                     } else {
                         // Space accessible but empty
@@ -372,6 +808,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[m][n]] = 1;
                         else
                             cm[p][b[m][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, m, n, -1, -1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -389,6 +826,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[m][n]] = 1;
                         else
                             cm[p][b[m][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, m, n, -1, 1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -406,6 +844,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[m][n]] = 1;
                         else
                             cm[p][b[m][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, m, n, 1, -1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -423,6 +862,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[m][n]] = 1;
                         else
                             cm[p][b[m][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, m, n, 1, 1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -446,6 +886,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[i][n]] = 1;
                         else
                             cm[p][b[i][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, i, n, 0, -1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -463,6 +904,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[i][n]] = 1;
                         else
                             cm[p][b[i][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, i, n, 0, 1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -480,6 +922,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[n][j]] = 1;
                         else
                             cm[p][b[n][j]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, n, j, -1, 0);
                         break;
                     } else {
                         // Space accessible but empty
@@ -497,6 +940,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[n][j]] = 1;
                         else
                             cm[p][b[n][j]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, n, j, 1, 0);
                         break;
                     } else {
                         // Space accessible but empty
@@ -514,6 +958,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[m][n]] = 1;
                         else
                             cm[p][b[m][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, m, n, -1, -1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -531,6 +976,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[m][n]] = 1;
                         else
                             cm[p][b[m][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, m, n, -1, 1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -548,6 +994,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[m][n]] = 1;
                         else
                             cm[p][b[m][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, m, n, 1, -1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -565,6 +1012,7 @@ void calcCM(int **cm, int **bAccessible, int **wAccessible, int **b, int sPawns[
                             cm[p2][b[m][n]] = 1;
                         else
                             cm[p][b[m][n]] = 1;
+                        if (xcm) xrayContact(xcm, isPromoted ? p2 : p, b, m, n, 1, 1);
                         break;
                     } else {
                         // Space accessible but empty
@@ -796,16 +1244,1354 @@ void printBoard_txt(int **b) {
     fprintf(stdout, "      a   b   c   d   e   f   g   h  \n");
 }
 
-void printCM(int **cm) {
+void printCM(FILE *f, int **cm) {
     int i, j;
-    fprintf(stdout, "   ");
-    for (i = 1; i < 33; i++) fprintf(stdout, "%2d ", i);
-    fprintf(stdout, "\n");
+    fprintf(f, "   ");
+    for (i = 1; i < 33; i++) fprintf(f, "%2d ", i);
+    fprintf(f, "\n");
     for (i = 1; i < 33; i++) {
-        fprintf(stdout, "%2d ", i);
+        fprintf(f, "%2d ", i);
         for (j = 1; j < 33; j++) {
-            fprintf(stdout, "%2d ", cm[i][j]);
+            fprintf(f, "%2d ", cm[i][j]);
         }
-        fprintf(stdout, "\n");
+        fprintf(f, "\n");
+    }
+}
+
+/*
+ * FEN/EPD parsing.
+ * A FEN board only tells the type of each piece, so the ids of restartBoard
+ * are given back by their home squares: pawns by file, bishops by the colour
+ * of their squares, rooks and knights left to right. Pieces that do not fit
+ * (promotions) take the id of a missing pawn and keep their type in pos->type.
+ */
+
+/* Ids of the black pieces; white ones are these plus 24 (8 for pawns) */
+#define B_ROOKL 1
+#define B_KNIGHTL 2
+#define B_BISHOPL 3
+#define B_QUEEN 4
+#define B_KING 5
+#define B_KNIGHTR 7
+#define B_BISHOPR 6
+#define B_ROOKR 8
+
+static int takeId(struct position_t *pos, int id, int type, int sq) {
+    if (pos->square[id] != -1) {
+        return 0;
+    }
+    pos->square[id] = sq;
+    pos->type[id] = type;
+    pos->board[sq] = id;
+    return 1;
+}
+
+/* Takes the free pawn id closest to the file of sq. A type of 0 keeps the
+ * piece a pawn. */
+static int takePawnId(struct position_t *pos, int white, int type, int sq) {
+    int base = white ? 17 : 9;
+    int file = sq % 8;
+    int d;
+    for (d = 0; d < 8; d++) {
+        // Nearest free pawn id, looking left first
+        if (file-d >= 0 && takeId(pos, base + file-d, type ? type : base + file-d, sq)) {
+            return 1;
+        }
+        if (d > 0 && file+d < 8 && takeId(pos, base + file+d, type ? type : base + file+d, sq)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Reads the board field into one letter per square (0 if empty). Returns a
+ * pointer past the field, or NULL if it is not a valid board. */
+static const char *readFENBoard(const char *c, char fenBoard[]) {
+    int sq = 0;
+    int p;
+
+    while (*c == ' ' || *c == '\t') {
+        c++;
+    }
+    for (; *c && !isspace((unsigned char) *c); c++) {
+        if (*c == '/') {
+            if (sq % 8 != 0) {
+                return NULL;
+            }
+        }
+        else if (*c >= '1' && *c <= '8') {
+            for (p = 0; p < *c - '0' && sq < 64; p++) {
+                fenBoard[sq++] = 0;
+            }
+        }
+        else if (strchr("prnbqkPRNBQK", *c) && sq < 64) {
+            fenBoard[sq++] = *c;
+        }
+        else {
+            return NULL;
+        }
+    }
+    return sq == 64 ? c : NULL;
+}
+
+/* Tags the pawn that can be taken en passant. c points past the board field:
+ * side to move and castling are not needed, only the en passant square. */
+static void readFENPassed(const char *c, struct position_t *pos) {
+    int p;
+    memset(pos->passed, 0, sizeof(pos->passed));
+    for (p = 0; p < 2; p++) {
+        while (*c && isspace((unsigned char) *c)) c++;
+        while (*c && !isspace((unsigned char) *c)) c++;
+    }
+    while (*c && isspace((unsigned char) *c)) c++;
+    if (c[0] >= 'a' && c[0] <= 'h' && (c[1] == '3' || c[1] == '6')) {
+        int ep = ('8' - c[1])*8 + (c[0] - 'a');
+        int pawn = c[1] == '3' ? pos->board[ep-8] : pos->board[ep+8];
+        if (pawn >= 9 && pawn <= 24 && pos->type[pawn] == pawn) {
+            pos->passed[ep] = pawn;
+        }
+    }
+}
+
+int parseFEN(const char *fen, struct position_t *pos) {
+    char fenBoard[64];
+    int sq;
+    int i, j, p;
+    const char *c;
+
+    if ((c = readFENBoard(fen, fenBoard)) == NULL) {
+        return -1;
+    }
+
+    memset(pos->board, 0, sizeof(pos->board));
+    memset(pos->passed, 0, sizeof(pos->passed));
+    for (p = 0; p < 33; p++) {
+        pos->type[p] = p;
+        pos->square[p] = -1;
+    }
+
+    /* Pawns first on their own file, then on the closest free file */
+    for (sq = 0; sq < 64; sq++) {
+        if (fenBoard[sq] == 'p' && takeId(pos, 9 + sq%8, 9 + sq%8, sq)) {
+            fenBoard[sq] = 0;
+        }
+        if (fenBoard[sq] == 'P' && takeId(pos, 17 + sq%8, 17 + sq%8, sq)) {
+            fenBoard[sq] = 0;
+        }
+    }
+    for (sq = 0; sq < 64; sq++) {
+        if (fenBoard[sq] == 'p' || fenBoard[sq] == 'P') {
+            int white = fenBoard[sq] == 'P';
+            if (!takePawnId(pos, white, 0, sq)) {
+                return -1;
+            }
+            fenBoard[sq] = 0;
+        }
+    }
+
+    /* Pieces, scanning files left to right so the left rook/knight comes first */
+    for (j = 0; j < 8; j++) {
+        for (i = 0; i < 8; i++) {
+            sq = i*8 + j;
+            if (!fenBoard[sq]) {
+                continue;
+            }
+            int white = isupper((unsigned char) fenBoard[sq]) != 0;
+            int off = white ? 24 : 0;
+            int done = 0;
+            switch (tolower((unsigned char) fenBoard[sq])) {
+                case 'r':
+                    done = takeId(pos, B_ROOKL+off, B_ROOKL+off, sq) ||
+                           takeId(pos, B_ROOKR+off, B_ROOKR+off, sq);
+                    p = B_ROOKL+off;
+                    break;
+                case 'n':
+                    done = takeId(pos, B_KNIGHTL+off, B_KNIGHTL+off, sq) ||
+                           takeId(pos, B_KNIGHTR+off, B_KNIGHTR+off, sq);
+                    p = B_KNIGHTL+off;
+                    break;
+                case 'b':
+                    // c8 and f1 are light squares, f8 and c1 dark
+                    if (((i + j) % 2 == 0) != white) {
+                        done = takeId(pos, B_BISHOPL+off, B_BISHOPL+off, sq);
+                    }
+                    else {
+                        done = takeId(pos, B_BISHOPR+off, B_BISHOPR+off, sq);
+                    }
+                    p = B_BISHOPL+off;
+                    break;
+                case 'q':
+                    done = takeId(pos, B_QUEEN+off, B_QUEEN+off, sq);
+                    p = B_QUEEN+off;
+                    break;
+                case 'k':
+                    if (!takeId(pos, B_KING+off, B_KING+off, sq)) {
+                        return -1;
+                    }
+                    done = 1;
+                    break;
+            }
+            if (!done && !takePawnId(pos, white, p, sq)) {
+                return -1;
+            }
+        }
+    }
+    if (pos->square[B_KING] == -1 || pos->square[B_KING+24] == -1) {
+        return -1;
+    }
+
+    readFENPassed(c, pos);
+    return 0;
+}
+
+/* FEN letter of each piece type */
+static const char typeLetter[] = " rnbqkbnrppppppppPPPPPPPPRNBQKBNR";
+
+/* Type given to a pawn promoted to the piece with this letter */
+static int promotionType(char letter) {
+    const char *t = strchr(typeLetter + 1, letter);
+    return t ? (int) (t - typeLetter) : 0;
+}
+
+int replayFEN(const char *fen, const struct position_t *prev, struct position_t *pos, uint32_t *moved, uint32_t *captured) {
+    char fenBoard[64];
+    int from[2], to[2];
+    int nFrom = 0, nTo = 0;
+    int sq, k;
+    const char *c;
+
+    if ((c = readFENBoard(fen, fenBoard)) == NULL) {
+        return -1;
+    }
+    for (sq = 0; sq < 64; sq++) {
+        char was = typeLetter[prev->type[prev->board[sq]]];
+        char now = fenBoard[sq] ? fenBoard[sq] : ' ';
+        if (was == now) {
+            continue;
+        }
+        if (now == ' ') {
+            if (nFrom == 2) return -1;
+            from[nFrom++] = sq;
+        }
+        else {
+            if (nTo == 2) return -1;
+            to[nTo++] = sq;
+        }
+    }
+
+    *pos = *prev;
+    *moved = *captured = 0;
+    if (nTo == 0 && nFrom == 0) {
+        // Same board again
+    }
+    else if (nTo == 1 && (nFrom == 1 || nFrom == 2)) {
+        /* A move or capture, maybe a promotion; or en passant, where the
+         * second square left empty is the pawn taken */
+        int mover = 0, taken = prev->board[to[0]];
+        char now = fenBoard[to[0]];
+        for (k = 0; k < nFrom; k++) {
+            int p = prev->board[from[k]];
+            if ((p > 16) == (isupper((unsigned char) now) != 0)) {
+                if (mover) return -1;
+                mover = p;
+            }
+            else {
+                if (taken) return -1;
+                taken = p;
+            }
+        }
+        if (!mover || (nFrom == 2 && !taken) || (taken && (taken > 16) == (mover > 16))) {
+            return -1;
+        }
+        if (typeLetter[prev->type[mover]] != now) {
+            // Only pawns change, on the last rank
+            int type = promotionType(now);
+            if (prev->type[mover] != mover || mover < 9 || mover > 24 || !type || type == 5 || type == 29 ||
+                (to[0] / 8 != 0 && to[0] / 8 != 7)) {
+                return -1;
+            }
+            pos->type[mover] = type;
+        }
+        if (taken) {
+            pos->board[pos->square[taken]] = 0;
+            pos->square[taken] = -1;
+            *captured = 1u << (taken-1);
+        }
+        pos->board[pos->square[mover]] = 0;
+        pos->board[to[0]] = mover;
+        pos->square[mover] = to[0];
+        *moved = 1u << (mover-1);
+    }
+    else if (nTo == 2 && nFrom == 2) {
+        /* Castling: the king and a rook swap over */
+        for (k = 0; k < 2; k++) {
+            int p = prev->board[from[k]];
+            int dest = fenBoard[to[0]] == typeLetter[prev->type[p]] ? to[0] : to[1];
+            if (fenBoard[dest] != typeLetter[prev->type[p]] || prev->board[dest]) {
+                return -1;
+            }
+            pos->board[from[k]] = 0;
+            *moved |= 1u << (p-1);
+        }
+        for (k = 0; k < 2; k++) {
+            int p = prev->board[from[k]];
+            int dest = fenBoard[to[0]] == typeLetter[prev->type[p]] ? to[0] : to[1];
+            pos->board[dest] = p;
+            pos->square[p] = dest;
+        }
+    }
+    else {
+        return -1;
+    }
+    readFENPassed(c, pos);
+    return 0;
+}
+
+void unpackPosition(const struct position_t *pos, int **b, int sPawns[], int **pPawns) {
+    int i, j, p;
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 8; j++) {
+            b[i][j] = pos->board[i*8 + j];
+            pPawns[i][j] = pos->passed[i*8 + j];
+        }
+    }
+    for (p = 0; p < 33; p++) {
+        sPawns[p] = pos->type[p] != p ? pos->type[p] : 0;
+    }
+}
+
+void unpackCM(const struct packedCM_t *pcm, int **cm) {
+    int p, q;
+    for (p = 1; p < 33; p++) {
+        for (q = 1; q < 33; q++) {
+            cm[p][q] = (pcm->row[p-1] >> (q-1)) & 1;
+        }
+    }
+}
+
+void packCM(int **cm, struct packedCM_t *pcm) {
+    int p, q;
+    for (p = 1; p < 33; p++) {
+        pcm->row[p-1] = 0;
+        for (q = 1; q < 33; q++) {
+            if (cm[p][q]) {
+                pcm->row[p-1] |= 1u << (q-1);
+            }
+        }
+    }
+}
+
+void countContacts(struct runStats_t *stats, const struct packedCM_t *cm) {
+    int r;
+    stats->positions++;
+    for (r = 0; r < 32; r++) {
+        // Rows 0-15 are the black pieces, 16-31 the white ones
+        uint32_t own = r < 16 ? 0x0000ffffu : 0xffff0000u;
+        stats->dcm += __builtin_popcount(cm->row[r] & own);
+        stats->tcm += __builtin_popcount(cm->row[r] & ~own);
+    }
+}
+
+/*
+ * Sparse (COO) output.
+ * Only the ones of the CMs are written, as (game, ply, i, j, kind) tuples,
+ * so the output grows with the number of contacts instead of 32x32.
+ */
+
+/* Kind of the contact of piece r+1 on piece q+1, on top of kinds */
+static inline int contactKind(int r, int q, int kinds) {
+    // Pieces 1-16 are black, 17-32 white
+    return kinds + ((r < 16) == (q < 16) ? KIND_DCM : KIND_TCM);
+}
+
+static void writeCOO(FILE *f, int format, const struct packedCM_t *cm, int kinds, const struct plyInfo_t *info) {
+    static const char *kindText[] = { "DCM", "TCM", "XDCM", "XTCM" };
+    unsigned char rec[COO_RECORD];
+    int r;
+    for (r = 0; r < 32; r++) {
+        uint32_t row = cm->row[r];
+        while (row) {
+            int q = __builtin_ctz(row);
+            int kind = contactKind(r, q, kinds);
+            row &= row - 1;
+            if (format == FORMAT_COO) {
+                fprintf(f, "%ld %d %d %d %s\n", info->game, info->ply, r + 1, q + 1, kindText[kind]);
+                continue;
+            }
+            rec[0] = info->game; rec[1] = info->game >> 8;
+            rec[2] = info->game >> 16; rec[3] = info->game >> 24;
+            rec[4] = info->ply; rec[5] = info->ply >> 8;
+            rec[6] = info->ply >> 16; rec[7] = info->ply >> 24;
+            rec[8] = r + 1;
+            rec[9] = q + 1;
+            rec[10] = kind;
+            rec[11] = 0;
+            fwrite(rec, COO_RECORD, 1, f);
+        }
+    }
+}
+
+void writeCM(FILE *f, int format, const struct packedCM_t *cm, const struct packedCM_t *xcm,
+             const struct plyInfo_t *info, int **scratch) {
+    if (format == FORMAT_MATRIX) {
+        unpackCM(cm, scratch);
+        printCM(f, scratch);
+        if (xcm) {
+            unpackCM(xcm, scratch);
+            printCM(f, scratch);
+        }
+        return;
+    }
+    writeCOO(f, format, cm, KIND_DCM, info);
+    if (xcm) writeCOO(f, format, xcm, KIND_XDCM, info);
+}
+
+/*
+ * Checkpoints.
+ * The checkpoint file is a few "key value" lines. It is written to a
+ * temporary file that is renamed over the old one, after the outputs have
+ * been flushed to disk, so it never points past what is really written.
+ */
+
+long syncOutput(FILE *f) {
+    fflush(f);
+    fsync(fileno(f));
+    return ftell(f);
+}
+
+FILE *openOutput(const char *fileName, long size) {
+    FILE *f;
+    if (size < 0) {
+        f = fopen(fileName, "w");
+    }
+    else if ((f = fopen(fileName, "r+")) != NULL) {
+        if (ftruncate(fileno(f), size) != 0 || fseek(f, size, SEEK_SET) != 0) {
+            fprintf(stderr, "Could not cut %s back to %ld bytes\n", fileName, size);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for writing\n", fileName);
+        exit(EXIT_FAILURE);
+    }
+    return f;
+}
+
+int writeCheckpoint(const char *fileName, const struct checkpoint_t *cp) {
+    char tmpName[4096];
+    FILE *f;
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", fileName);
+    if ((f = fopen(tmpName, "w")) == NULL) {
+        return -1;
+    }
+    fprintf(f, "cmatrix-checkpoint 2\n");
+    fprintf(f, "input %ld\n", cp->input);
+    fprintf(f, "output %ld\n", cp->output);
+    fprintf(f, "lifetimes %ld\n", cp->lifetimes);
+    fprintf(f, "xray %d\n", cp->xray);
+    fprintf(f, "format %d\n", cp->format);
+    fprintf(f, "games %ld\n", cp->stats.games);
+    fprintf(f, "positions %ld\n", cp->stats.positions);
+    fprintf(f, "skipped %ld\n", cp->stats.skipped);
+    fprintf(f, "dcm %lld\n", cp->stats.dcm);
+    fprintf(f, "tcm %lld\n", cp->stats.tcm);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return rename(tmpName, fileName);
+}
+
+int readCheckpoint(const char *fileName, struct checkpoint_t *cp) {
+    FILE *f;
+    int version = 0;
+    int fields;
+    if ((f = fopen(fileName, "r")) == NULL) {
+        return -1;
+    }
+    fields = fscanf(f, "cmatrix-checkpoint %d input %ld output %ld lifetimes %ld xray %d format %d "
+                       "games %ld positions %ld skipped %ld dcm %lld tcm %lld",
+                    &version, &cp->input, &cp->output, &cp->lifetimes, &cp->xray, &cp->format,
+                    &cp->stats.games, &cp->stats.positions, &cp->stats.skipped,
+                    &cp->stats.dcm, &cp->stats.tcm);
+    fclose(f);
+    return fields == 11 && version == 2 ? 0 : -1;
+}
+
+/*
+ * Contact lifetimes.
+ * Consecutive CMs of a game are XORed: new bits are contacts that appear and
+ * get the current ply as birth, old bits are contacts that end. A contact
+ * ends by "capture" if one of the two pieces was taken, by "move" if one of
+ * them moved, and by "block" otherwise (a piece stepped in between, or an en
+ * passant chance went away). Contacts alive at the end of the game end with
+ * "end". Each line of the file is
+ *     game i j DCM|TCM born died reason
+ * where the contact was there from ply born to ply died-1.
+ */
+
+static void writeLifetime(FILE *f, long game, int p, int q, int born, int died, const char *reason) {
+    fprintf(f, "%ld %d %d %s %d %d %s\n", game, p, q, (p > 16) == (q > 16) ? "DCM" : "TCM", born, died, reason);
+}
+
+void trackLifetimes(struct lifetimes_t *lt, const struct packedCM_t *cm, const struct plyInfo_t *info, FILE *f) {
+    int r;
+    if (info->game != lt->game) {
+        endLifetimes(lt, f);
+        lt->game = info->game;
+        memset(&lt->last, 0, sizeof(lt->last));
+    }
+    uint32_t touched = info->moved | info->captured;
+    for (r = 0; r < 32; r++) {
+        uint32_t changed = lt->last.row[r] ^ cm->row[r];
+        uint32_t gone = changed & lt->last.row[r];
+        uint32_t born = changed & cm->row[r];
+        while (gone) {
+            int q = __builtin_ctz(gone);
+            uint32_t pair = (1u << r) | (1u << q);
+            writeLifetime(f, lt->game, r+1, q+1, lt->born[r][q], info->ply,
+                          info->captured & pair ? "capture" : touched & pair ? "move" : "block");
+            gone &= gone - 1;
+        }
+        while (born) {
+            lt->born[r][__builtin_ctz(born)] = info->ply;
+            born &= born - 1;
+        }
+    }
+    lt->last = *cm;
+    lt->ply = info->ply;
+}
+
+void endLifetimes(struct lifetimes_t *lt, FILE *f) {
+    int r;
+    if (!lt->game) {
+        return;
+    }
+    for (r = 0; r < 32; r++) {
+        uint32_t live = lt->last.row[r];
+        while (live) {
+            int q = __builtin_ctz(live);
+            writeLifetime(f, lt->game, r+1, q+1, lt->born[r][q], lt->ply+1, "end");
+            live &= live - 1;
+        }
+    }
+    lt->game = 0;
+}
+
+/*
+ * Batch CM kernel.
+ * The positions are processed CM_LANES at a time, one position per 64 bit
+ * lane. For every piece id the rays of the rooks, bishops and queens holding
+ * that id in any of the lanes are computed together with Kogge-Stone fills,
+ * so the cost does not depend on how far the pieces can slide. Knights,
+ * pawns and kings come from tables. The result is the same as calcCM's.
+ */
+
+#define CM_LANES 4
+
+#define NOT_J0  0xfefefefefefefefeULL   /* Everything but column 0 */
+#define NOT_J7  0x7f7f7f7f7f7f7f7fULL   /* Everything but column 7 */
+#define NOT_J01 0xfcfcfcfcfcfcfcfcULL
+#define NOT_J67 0x3f3f3f3f3f3f3f3fULL
+
+/* Sliding pieces sharing an id across the lanes */
+struct sliderLanes_t {
+    uint64_t orth[CM_LANES];    /* Rooks and queens */
+    uint64_t diag[CM_LANES];    /* Bishops and queens */
+    uint64_t empty[CM_LANES];
+};
+
+static uint64_t knightTable[64];
+static uint64_t kingTable[64];
+static uint64_t bPawnTable[64];
+static uint64_t wPawnTable[64];
+/* Board without pieces, to pad short batches */
+static struct position_t emptyPosition;
+
+static void sliderAttacks_scalar(const struct sliderLanes_t*, uint64_t[], uint64_t[]);
+static void (*sliderAttacks)(const struct sliderLanes_t*, uint64_t[], uint64_t[]) = sliderAttacks_scalar;
+
+/* The eight rays: rooks use the first four, bishops the last four */
+static const int rayUp[8] = {1, 0, 1, 0, 1, 1, 0, 0};
+static const int rayShift[8] = {1, 1, 8, 8, 9, 7, 7, 9};
+static const uint64_t rayMask[8] = {NOT_J0, NOT_J7, ~0ULL, ~0ULL, NOT_J0, NOT_J7, NOT_J0, NOT_J7};
+
+/* Occluded fills: the squares reached from gen through the empty squares in
+ * pro, one direction at a time, including the first blocker. m removes the
+ * squares wrapped around from the other side of the board. */
+static inline uint64_t fillUp(uint64_t gen, uint64_t pro, int s, uint64_t m) {
+    pro &= m;
+    gen |= pro & (gen << s);
+    pro &= pro << s;
+    gen |= pro & (gen << 2*s);
+    pro &= pro << 2*s;
+    gen |= pro & (gen << 4*s);
+    return (gen << s) & m;
+}
+
+static inline uint64_t fillDown(uint64_t gen, uint64_t pro, int s, uint64_t m) {
+    pro &= m;
+    gen |= pro & (gen >> s);
+    pro &= pro >> s;
+    gen |= pro & (gen >> 2*s);
+    pro &= pro >> 2*s;
+    gen |= pro & (gen >> 4*s);
+    return (gen >> s) & m;
+}
+
+static inline uint64_t fillRay(int d, uint64_t gen, uint64_t pro) {
+    return rayUp[d] ? fillUp(gen, pro, rayShift[d], rayMask[d]) : fillDown(gen, pro, rayShift[d], rayMask[d]);
+}
+
+/* Attacks of the sliders of each lane. If xray is not NULL it also gets the
+ * pieces behind the first blocker of each ray, filling on from the blocker
+ * in the same pass. */
+static void sliderAttacks_scalar(const struct sliderLanes_t *in, uint64_t att[], uint64_t xray[]) {
+    int l, d;
+    for (l = 0; l < CM_LANES; l++) {
+        uint64_t e = in->empty[l];
+        uint64_t a = 0, x = 0;
+        for (d = 0; d < 8; d++) {
+            uint64_t gen = d < 4 ? in->orth[l] : in->diag[l];
+            if (!gen) {
+                continue;
+            }
+            uint64_t r = fillRay(d, gen, e);
+            a |= r;
+            if (xray) {
+                x |= fillRay(d, r & ~e, e) & ~e;
+            }
+        }
+        att[l] = a;
+        if (xray) {
+            xray[l] = x;
+        }
+    }
+}
+
+#ifdef HAVE_AVX2_KERNEL
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i fillUp_avx2(__m256i gen, __m256i pro, int s, __m256i m) {
+    __m128i s1 = _mm_cvtsi32_si128(s);
+    __m128i s2 = _mm_cvtsi32_si128(2*s);
+    __m128i s4 = _mm_cvtsi32_si128(4*s);
+    pro = _mm256_and_si256(pro, m);
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_sll_epi64(gen, s1)));
+    pro = _mm256_and_si256(pro, _mm256_sll_epi64(pro, s1));
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_sll_epi64(gen, s2)));
+    pro = _mm256_and_si256(pro, _mm256_sll_epi64(pro, s2));
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_sll_epi64(gen, s4)));
+    return _mm256_and_si256(_mm256_sll_epi64(gen, s1), m);
+}
+
+AVX2 static inline __m256i fillDown_avx2(__m256i gen, __m256i pro, int s, __m256i m) {
+    __m128i s1 = _mm_cvtsi32_si128(s);
+    __m128i s2 = _mm_cvtsi32_si128(2*s);
+    __m128i s4 = _mm_cvtsi32_si128(4*s);
+    pro = _mm256_and_si256(pro, m);
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_srl_epi64(gen, s1)));
+    pro = _mm256_and_si256(pro, _mm256_srl_epi64(pro, s1));
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_srl_epi64(gen, s2)));
+    pro = _mm256_and_si256(pro, _mm256_srl_epi64(pro, s2));
+    gen = _mm256_or_si256(gen, _mm256_and_si256(pro, _mm256_srl_epi64(gen, s4)));
+    return _mm256_and_si256(_mm256_srl_epi64(gen, s1), m);
+}
+
+AVX2 static inline __m256i fillRay_avx2(int d, __m256i gen, __m256i pro) {
+    __m256i m = _mm256_set1_epi64x((long long) rayMask[d]);
+    return rayUp[d] ? fillUp_avx2(gen, pro, rayShift[d], m) : fillDown_avx2(gen, pro, rayShift[d], m);
+}
+
+AVX2 static void sliderAttacks_avx2(const struct sliderLanes_t *in, uint64_t att[], uint64_t xray[]) {
+    __m256i o = _mm256_loadu_si256((const __m256i*) in->orth);
+    __m256i dg = _mm256_loadu_si256((const __m256i*) in->diag);
+    __m256i e = _mm256_loadu_si256((const __m256i*) in->empty);
+    __m256i a = _mm256_setzero_si256();
+    __m256i x = _mm256_setzero_si256();
+    int d;
+    for (d = 0; d < 8; d++) {
+        __m256i gen = d < 4 ? o : dg;
+        if (_mm256_testz_si256(gen, gen)) {
+            continue;
+        }
+        __m256i r = fillRay_avx2(d, gen, e);
+        a = _mm256_or_si256(a, r);
+        if (xray) {
+            r = fillRay_avx2(d, _mm256_andnot_si256(e, r), e);
+            x = _mm256_or_si256(x, _mm256_andnot_si256(e, r));
+        }
+    }
+    _mm256_storeu_si256((__m256i*) att, a);
+    if (xray) {
+        _mm256_storeu_si256((__m256i*) xray, x);
+    }
+}
+#endif
+
+void initCMKernel(void) {
+    int sq, n;
+    static const int K_moves[8][2] = { {-1, 2}, {1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1} };
+    for (sq = 0; sq < 64; sq++) {
+        int i = sq / 8;
+        int j = sq % 8;
+        knightTable[sq] = kingTable[sq] = bPawnTable[sq] = wPawnTable[sq] = 0;
+        for (n = 0; n < 8; n++) {
+            int x = i + K_moves[n][0];
+            int y = j + K_moves[n][1];
+            if (x >= 0 && x < 8 && y >= 0 && y < 8) {
+                knightTable[sq] |= 1ULL << (x*8 + y);
+            }
+        }
+        int m, k;
+        for (m = i-1; m <= i+1; m++) {
+            for (k = j-1; k <= j+1; k++) {
+                if (m >= 0 && m < 8 && k >= 0 && k < 8 && (m != i || k != j)) {
+                    kingTable[sq] |= 1ULL << (m*8 + k);
+                }
+            }
+        }
+        if (i+1 < 8 && j-1 >= 0) bPawnTable[sq] |= 1ULL << ((i+1)*8 + j-1);
+        if (i+1 < 8 && j+1 < 8)  bPawnTable[sq] |= 1ULL << ((i+1)*8 + j+1);
+        if (i-1 >= 0 && j-1 >= 0) wPawnTable[sq] |= 1ULL << ((i-1)*8 + j-1);
+        if (i-1 >= 0 && j+1 < 8)  wPawnTable[sq] |= 1ULL << ((i-1)*8 + j+1);
+    }
+    memset(&emptyPosition, 0, sizeof(emptyPosition));
+    memset(emptyPosition.square, -1, sizeof(emptyPosition.square));
+
+    sliderAttacks = sliderAttacks_scalar;
+#ifdef HAVE_AVX2_KERNEL
+    __builtin_cpu_init();
+    if (!globalArgs.scalar && __builtin_cpu_supports("avx2")) {
+        sliderAttacks = sliderAttacks_avx2;
+    }
+#endif
+    if (globalArgs.verbose) {
+        fprintf(stderr, "CM kernel: %s\n", sliderAttacks == sliderAttacks_scalar ? "scalar" : "AVX2");
+    }
+}
+
+/* Sets the bits of the pieces found on the squares of att in row */
+static inline uint32_t contactRow(uint64_t att, const unsigned char *board) {
+    uint32_t row = 0;
+    while (att) {
+        row |= 1u << (board[__builtin_ctzll(att)] - 1);
+        att &= att - 1;
+    }
+    return row;
+}
+
+static void calcCM_lanes(const struct position_t *pos[], struct packedCM_t *cm[], struct packedCM_t *xcm[]) {
+    uint64_t occ[CM_LANES], passed[CM_LANES];
+    struct sliderLanes_t sl;
+    uint64_t att[CM_LANES], xatt[CM_LANES];
+    int l, p, sq;
+
+    for (l = 0; l < CM_LANES; l++) {
+        occ[l] = passed[l] = 0;
+        for (p = 1; p < 33; p++) {
+            if (pos[l]->square[p] >= 0) {
+                occ[l] |= 1ULL << pos[l]->square[p];
+            }
+        }
+        for (sq = 0; sq < 64; sq++) {
+            if (pos[l]->passed[sq]) {
+                passed[l] |= 1ULL << sq;
+            }
+        }
+        sl.empty[l] = ~occ[l];
+        memset(cm[l], 0, sizeof(struct packedCM_t));
+        if (xcm) {
+            memset(xcm[l], 0, sizeof(struct packedCM_t));
+        }
+    }
+
+    for (p = 1; p < 33; p++) {
+        int sliders = 0;
+        for (l = 0; l < CM_LANES; l++) {
+            const struct position_t *ps = pos[l];
+            sl.orth[l] = sl.diag[l] = 0;
+            if ((sq = ps->square[p]) < 0) {
+                continue;
+            }
+            uint64_t bit = 1ULL << sq;
+            uint64_t a;
+            switch (ps->type[p]) {
+                case 1: case 8: case 25: case 32:
+                    sl.orth[l] = bit;
+                    sliders = 1;
+                    continue;
+                case 3: case 6: case 27: case 30:
+                    sl.diag[l] = bit;
+                    sliders = 1;
+                    continue;
+                case 4: case 28:
+                    sl.orth[l] = sl.diag[l] = bit;
+                    sliders = 1;
+                    continue;
+                case 2: case 7: case 26: case 31:
+                    a = knightTable[sq];
+                    break;
+                case 5: case 29:
+                    a = kingTable[sq];
+                    break;
+                default:
+                    a = ps->type[p] <= 16 ? bPawnTable[sq] : wPawnTable[sq];
+                    cm[l]->row[p-1] |= contactRow(a & passed[l], ps->passed);
+                    break;
+            }
+            // The accessible maps of calcCM only mark empty squares, so
+            // they never stop a king from contacting a piece
+            cm[l]->row[p-1] |= contactRow(a & occ[l], ps->board);
+        }
+        if (!sliders) {
+            continue;
+        }
+        sliderAttacks(&sl, att, xcm ? xatt : NULL);
+        for (l = 0; l < CM_LANES; l++) {
+            if (sl.orth[l] | sl.diag[l]) {
+                cm[l]->row[p-1] |= contactRow(att[l] & occ[l], pos[l]->board);
+                if (xcm) {
+                    xcm[l]->row[p-1] |= contactRow(xatt[l], pos[l]->board);
+                }
+            }
+        }
+    }
+}
+
+/* Calls from several threads at once are fine (daemon mode): the padding
+ * board is set up by initCMKernel and the padding results are local */
+void calcCM_batch(const struct position_t *pos, struct packedCM_t *cm, struct packedCM_t *xcm, int n) {
+    struct packedCM_t discard[2][CM_LANES];
+    const struct position_t *lanePos[CM_LANES];
+    struct packedCM_t *laneCM[CM_LANES];
+    struct packedCM_t *laneXCM[CM_LANES];
+    int k, l;
+
+    for (k = 0; k < n; k += CM_LANES) {
+        for (l = 0; l < CM_LANES; l++) {
+            // Short batches are padded with empty boards
+            lanePos[l] = k+l < n ? &pos[k+l] : &emptyPosition;
+            laneCM[l] = k+l < n ? &cm[k+l] : &discard[0][l];
+            laneXCM[l] = xcm && k+l < n ? &xcm[k+l] : &discard[1][l];
+        }
+        calcCM_lanes(lanePos, laneCM, xcm ? laneXCM : NULL);
+    }
+}
+
+/*
+ * Daemon mode.
+ * The server sets up the kernel tables once and every worker keeps its batch
+ * buffers, so a request only costs the parsing, the kernel and the socket.
+ * Each line of a connection is a position on its own (parseFEN, no game is
+ * replayed) and gets one frame, in the order of the lines. A client can send
+ * many lines before reading, and all the complete lines of one read go to
+ * the kernel together. The workers wait on one epoll set whose events are
+ * one-shot: a connection is served by a single worker at a time, so its
+ * frames cannot be reordered, and the worker that wakes up answers it
+ * without handing it over.
+ * The sockets do not block. When a client does not read its answers, what
+ * does not fit in the socket is kept with the connection, which waits for
+ * EPOLLOUT and reads no more lines until it is sent, so a slow client never
+ * holds a worker.
+ */
+
+struct connection_t {
+    int fd;
+    size_t used;                /* Bytes of lines not answered yet */
+    int skipping;               /* Inside a line too long to answer */
+    unsigned char *pending;     /* Answers the socket did not take yet */
+    size_t pendingSize, pendingUsed, pendingSent;
+    char in[REQUEST_LINE];
+};
+
+struct server_t {
+    int listenFd;
+    int epollFd;
+    int flags;                  /* FRAME_* flags of the payloads */
+    long requests;
+    long connections;
+};
+
+/* Largest payload: every contact twice (x-ray), 3 bytes each */
+#define FRAME_PAYLOAD (2*32*32*3)
+
+static unsigned char *putPacked(unsigned char *p, const struct packedCM_t *cm) {
+    int r;
+    for (r = 0; r < 32; r++) {
+        p[0] = cm->row[r]; p[1] = cm->row[r] >> 8;
+        p[2] = cm->row[r] >> 16; p[3] = cm->row[r] >> 24;
+        p += 4;
+    }
+    return p;
+}
+
+static unsigned char *putSparse(unsigned char *p, const struct packedCM_t *cm, int kinds) {
+    int r;
+    for (r = 0; r < 32; r++) {
+        uint32_t row = cm->row[r];
+        while (row) {
+            int q = __builtin_ctz(row);
+            row &= row - 1;
+            p[0] = r + 1;
+            p[1] = q + 1;
+            p[2] = contactKind(r, q, kinds);
+            p += 3;
+        }
+    }
+    return p;
+}
+
+/* Writes the frame of a position (cm NULL if the line was not one) and
+ * returns a pointer past it */
+static unsigned char *putFrame(unsigned char *f, int flags, const struct packedCM_t *cm, const struct packedCM_t *xcm) {
+    unsigned char *p = f + FRAME_HEADER;
+    if (cm) {
+        if (flags & FRAME_SPARSE) {
+            p = putSparse(p, cm, KIND_DCM);
+            if (xcm) p = putSparse(p, xcm, KIND_XDCM);
+        }
+        else {
+            p = putPacked(p, cm);
+            if (xcm) p = putPacked(p, xcm);
+        }
+    }
+    f[0] = cm ? FRAME_OK : FRAME_BAD;
+    f[1] = flags;
+    f[2] = (p - f - FRAME_HEADER);
+    f[3] = (p - f - FRAME_HEADER) >> 8;
+    return p;
+}
+
+static int writeAll(int fd, const unsigned char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return -1;
+        }
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static int readAll(int fd, unsigned char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t r = read(fd, buf, n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        buf += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/* Buffers of a worker, kept for the life of the server */
+struct worker_t {
+    struct server_t *server;
+    struct position_t batch[CM_BATCH];
+    struct packedCM_t cm[CM_BATCH];
+    struct packedCM_t xcm[CM_BATCH];
+    int parsed[CM_BATCH];       /* Lines that were positions */
+    unsigned char out[CM_BATCH * (FRAME_HEADER + FRAME_PAYLOAD)];
+};
+
+/* Answers lines[0..n-1] (NULL for a line too long) into the buffer of the
+ * worker. Returns the size of the answers. */
+static size_t answerLines(struct worker_t *w, char *lines[], int n) {
+    int flags = w->server->flags;
+    unsigned char *p = w->out;
+    int k, m = 0;
+    for (k = 0; k < n; k++) {
+        w->parsed[k] = lines[k] && parseFEN(lines[k], &w->batch[m]) == 0;
+        m += w->parsed[k];
+    }
+    calcCM_batch(w->batch, w->cm, (flags & FRAME_XRAY) ? w->xcm : NULL, m);
+    for (k = m = 0; k < n; k++) {
+        if (w->parsed[k]) {
+            p = putFrame(p, flags, &w->cm[m], (flags & FRAME_XRAY) ? &w->xcm[m] : NULL);
+            m++;
+        }
+        else {
+            p = putFrame(p, flags, NULL, NULL);
+        }
+    }
+    __atomic_add_fetch(&w->server->requests, n, __ATOMIC_RELAXED);
+    return p - w->out;
+}
+
+/* Writes what the socket takes without blocking. Returns the number of
+ * bytes written, or -1 if the connection is gone. */
+static ssize_t writeSome(int fd, const unsigned char *buf, size_t n) {
+    size_t sent = 0;
+    while (sent < n) {
+        ssize_t w = write(fd, buf + sent, n - sent);
+        if (w > 0) {
+            sent += w;
+        }
+        else if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        else {
+            return -1;
+        }
+    }
+    return sent;
+}
+
+/* Sends the answers of a connection, keeping what the socket does not take.
+ * Returns -1 if the connection is gone. */
+static int sendAnswers(struct connection_t *conn, const unsigned char *buf, size_t n) {
+    ssize_t sent = writeSome(conn->fd, buf, n);
+    if (sent < 0) {
+        return -1;
+    }
+    if ((size_t) sent == n) {
+        return 0;
+    }
+    if (conn->pendingSize < n - sent) {
+        free(conn->pending);
+        conn->pendingSize = n - sent;
+        if ((conn->pending = malloc(conn->pendingSize)) == NULL) {
+            return -1;
+        }
+    }
+    memcpy(conn->pending, buf + sent, n - sent);
+    conn->pendingUsed = n - sent;
+    conn->pendingSent = 0;
+    return 0;
+}
+
+/* Answers up to CM_BATCH of the complete lines read from a connection.
+ * Returns the number of lines answered, or -1 if the connection is gone. */
+static int answerConnection(struct worker_t *w, struct connection_t *conn) {
+    char *lines[CM_BATCH];
+    char *c = conn->in, *end = conn->in + conn->used, *nl;
+    int n = 0;
+
+    if (conn->skipping) {
+        // The rest of a line already answered as too long
+        if ((nl = memchr(c, '\n', end - c)) == NULL) {
+            conn->used = 0;
+            return 0;
+        }
+        conn->skipping = 0;
+        c = nl + 1;
+    }
+    for (; n < CM_BATCH && (nl = memchr(c, '\n', end - c)) != NULL; c = nl + 1) {
+        *nl = '\0';
+        lines[n++] = c;
+    }
+    if (n == 0 && c == conn->in && conn->used == sizeof(conn->in)) {
+        // No position is that long: it is answered as bad and skipped
+        lines[n++] = NULL;
+        conn->skipping = 1;
+        c = end;
+    }
+    if (n > 0 && sendAnswers(conn, w->out, answerLines(w, lines, n)) != 0) {
+        return -1;
+    }
+    conn->used = end - c;
+    memmove(conn->in, c, conn->used);
+    return n;
+}
+
+/* Serves a connection until it waits for the client. Returns EPOLLIN or
+ * EPOLLOUT, what to wait for, or -1 when it has to be closed. */
+static int serveConnection(struct worker_t *w, struct connection_t *conn) {
+    int haveRead = 0;
+    ssize_t r;
+
+    for (;;) {
+        if (conn->pendingSent < conn->pendingUsed) {
+            r = writeSome(conn->fd, conn->pending + conn->pendingSent, conn->pendingUsed - conn->pendingSent);
+            if (r < 0) {
+                return -1;
+            }
+            conn->pendingSent += r;
+            if (conn->pendingSent < conn->pendingUsed) {
+                return EPOLLOUT;
+            }
+        }
+        if ((r = answerConnection(w, conn)) < 0) {
+            return -1;
+        }
+        if (r > 0) {
+            continue;
+        }
+        // One read per wake-up, so that a busy client does not keep the
+        // worker from the others
+        if (haveRead) {
+            return EPOLLIN;
+        }
+        r = read(conn->fd, conn->in + conn->used, sizeof(conn->in) - conn->used);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return EPOLLIN;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        conn->used += r;
+        haveRead = 1;
+    }
+}
+
+static void *serveWorker(void *arg) {
+    struct worker_t *w = arg;
+    struct server_t *srv = w->server;
+    struct epoll_event ev;
+    int wait;
+
+    for (;;) {
+        if (epoll_wait(srv->epollFd, &ev, 1, -1) != 1) {
+            continue;
+        }
+        struct connection_t *conn = ev.data.ptr;
+        if (conn == NULL) {
+            // The listening socket: take one client and wait for the next
+            int fd = accept(srv->listenFd, NULL, NULL);
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.ptr = NULL;
+            epoll_ctl(srv->epollFd, EPOLL_CTL_MOD, srv->listenFd, &ev);
+            if (fd < 0) {
+                continue;
+            }
+            if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ||
+                (conn = calloc(1, sizeof(struct connection_t))) == NULL) {
+                close(fd);
+                continue;
+            }
+            conn->fd = fd;
+            ev.data.ptr = conn;
+            if (epoll_ctl(srv->epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                close(fd);
+                free(conn);
+                continue;
+            }
+            __atomic_add_fetch(&srv->connections, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if ((wait = serveConnection(w, conn)) < 0) {
+            epoll_ctl(srv->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+            close(conn->fd);
+            free(conn->pending);
+            free(conn);
+            continue;
+        }
+        ev.events = wait | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        epoll_ctl(srv->epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+    }
+    return NULL;
+}
+
+/* Fills the address of a socket file. Returns -1 if the name is too long. */
+static int socketAddress(const char *name, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(name) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    strcpy(addr->sun_path, name);
+    return 0;
+}
+
+void serveCM(const char *socketName, int workers) {
+    static struct server_t srv;
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+    sigset_t stop;
+    int i, sig;
+
+    if (socketAddress(socketName, &addr) != 0) {
+        fprintf(stderr, "Socket name %s is too long\n", socketName);
+        exit(EXIT_FAILURE);
+    }
+    if (workers <= 0 && (workers = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) {
+        workers = 1;
+    }
+    initCMKernel();
+    srv.flags = (globalArgs.format == FORMAT_MATRIX ? 0 : FRAME_SPARSE) |
+                (globalArgs.xray ? FRAME_XRAY : 0);
+
+    if ((srv.listenFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        fcntl(srv.listenFd, F_SETFL, O_NONBLOCK) != 0) {
+        fprintf(stderr, "Could not create a socket: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int bound = bind(srv.listenFd, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        // A socket file left by a server that is gone is taken over
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "A server is already listening on %s\n", socketName);
+            exit(EXIT_FAILURE);
+        }
+        close(probe);
+        unlink(socketName);
+        bound = bind(srv.listenFd, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+    }
+    if (!bound || listen(srv.listenFd, 128) != 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", socketName, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if ((srv.epollFd = epoll_create1(0)) < 0) {
+        fprintf(stderr, "Could not create an epoll set: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = NULL;
+    epoll_ctl(srv.epollFd, EPOLL_CTL_ADD, srv.listenFd, &ev);
+
+    // The workers never see the signals: the main thread waits for them
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+    for (i = 0; i < workers; i++) {
+        struct worker_t *w = malloc(sizeof(struct worker_t));
+        pthread_t thread;
+        if (w == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        w->server = &srv;
+        if (pthread_create(&thread, NULL, serveWorker, w) != 0) {
+            fprintf(stderr, "Could not start worker %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (globalArgs.verbose) {
+        fprintf(stderr, "Serving %s CMs on %s with %d workers\n",
+                srv.flags & FRAME_SPARSE ? "sparse" : "packed", socketName, workers);
+    }
+    sigwait(&stop, &sig);
+    unlink(socketName);
+    fprintf(stderr, "Connections = %ld\n", __atomic_load_n(&srv.connections, __ATOMIC_RELAXED));
+    fprintf(stderr, "Requests = %ld\n", __atomic_load_n(&srv.requests, __ATOMIC_RELAXED));
+    exit(EXIT_SUCCESS);
+}
+
+/* Reads a packed or sparse payload back into CMs */
+static void readPayload(const unsigned char *p, int flags, int size, struct packedCM_t *cm, struct packedCM_t *xcm) {
+    int r, k;
+    memset(cm, 0, sizeof(*cm));
+    memset(xcm, 0, sizeof(*xcm));
+    if (flags & FRAME_SPARSE) {
+        for (k = 0; k + 3 <= size; k += 3) {
+            struct packedCM_t *m = p[k+2] >= KIND_XDCM ? xcm : cm;
+            m->row[p[k] - 1] |= 1u << (p[k+1] - 1);
+        }
+        return;
+    }
+    for (r = 0; r < 64 && 4*r + 4 <= size; r++) {
+        uint32_t row = p[4*r] | (uint32_t) p[4*r+1] << 8 | (uint32_t) p[4*r+2] << 16 | (uint32_t) p[4*r+3] << 24;
+        (r < 32 ? cm : xcm)->row[r % 32] = row;
+    }
+}
+
+static int compareLong(const void *a, const void *b) {
+    long x = *(const long*) a, y = *(const long*) b;
+    return x < y ? -1 : x > y;
+}
+
+void queryCM(const char *socketName, FILE *inputF) {
+    struct sockaddr_un addr;
+    struct runStats_t stats;
+    struct packedCM_t cm, xcm;
+    struct plyInfo_t info;
+    unsigned char header[FRAME_HEADER], payload[FRAME_PAYLOAD];
+    int **scratch = allocCM();
+    long *latency = NULL;
+    size_t latencySize = 0;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    int fd;
+
+    if (socketAddress(socketName, &addr) != 0 ||
+        (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Could not connect to %s\n", socketName);
+        exit(EXIT_FAILURE);
+    }
+    memset(&stats, 0, sizeof(stats));
+    memset(&info, 0, sizeof(info));
+    while ((read = getline(&line, &len, inputF)) != -1) {
+        struct timespec sent, answered;
+        if (strncmp(line, "[", 1) == 0 || strspn(line, " \t\r\n") == (size_t) read) {
+            continue;
+        }
+        if (line[read-1] != '\n') {
+            if ((size_t) read + 1 >= len && (line = realloc(line, len = read + 2)) == NULL) {
+                fprintf(stderr, "ERROR: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            line[read++] = '\n';
+            line[read] = '\0';
+        }
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        int size;
+        if (writeAll(fd, (unsigned char*) line, read) != 0 ||
+            readAll(fd, header, FRAME_HEADER) != 0 ||
+            (size = header[2] | header[3] << 8) > FRAME_PAYLOAD ||
+            readAll(fd, payload, size) != 0) {
+            fprintf(stderr, "The server on %s stopped answering\n", socketName);
+            exit(EXIT_FAILURE);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &answered);
+        if ((size_t) stats.positions + stats.skipped == latencySize) {
+            latencySize = latencySize ? 2*latencySize : 1024;
+            if ((latency = realloc(latency, latencySize * sizeof(long))) == NULL) {
+                fprintf(stderr, "ERROR: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        latency[stats.positions + stats.skipped] = (answered.tv_sec - sent.tv_sec) * 1000000000L +
+                                                   (answered.tv_nsec - sent.tv_nsec);
+        if (header[0] != FRAME_OK) {
+            fprintf(stderr, "WARNING: could not parse position: %s", line);
+            stats.skipped++;
+            continue;
+        }
+        readPayload(payload, header[1], size, &cm, &xcm);
+        info.game = ++stats.games;
+        writeCM(globalArgs.outFile, globalArgs.format, &cm,
+                (header[1] & FRAME_XRAY) ? &xcm : NULL, &info, scratch);
+        countContacts(&stats, &cm);
+    }
+    close(fd);
+    free(line);
+    if (globalArgs.outFileName) {
+        fclose(globalArgs.outFile);
+    }
+
+    long n = stats.positions + stats.skipped;
+    fprintf(stderr, "Positions = %ld (%ld lines skipped)\n", stats.positions, stats.skipped);
+    if (stats.positions) {
+        fprintf(stderr, "Contacts per position = %.2f DCM, %.2f TCM\n",
+                (double) stats.dcm / stats.positions, (double) stats.tcm / stats.positions);
+    }
+    if (n) {
+        qsort(latency, n, sizeof(long), compareLong);
+        fprintf(stderr, "Latency p50 = %.1f us, p99 = %.1f us, max = %.1f us\n",
+                latency[(n-1) / 2] / 1e3, latency[(n-1) * 99 / 100] / 1e3, latency[n-1] / 1e3);
     }
+    free(latency);
 }
@@ -1,19 +1,92 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/resource.h>
 
 struct globalArgs_t {
-  int input;                  /* -i input */
-  char *inFileName;
-  FILE *inFile;
+  int output;                 /* solutions are printed */
+  char *outFileName;          /* -o option */
+  FILE *outFile;
+  int specular;               /* -s option */
+  char *energyFileName;       /* -E option */
+  FILE *energyFile;
+  char *newickFileName;       /* -n option */
+  FILE *newickFile;
+  int countOnly;              /* -c option */
+  int boundingBox[3];         /* -b option, sides from the shortest */
+  int maxSolutions;           /* -M option */
+  int threads;                /* -j option */
+  int splitDepth;             /* -d option */
+  int newickDepth;            /* -L option */
+  int pruning;                /* -p option, PRUNE_ bits */
+  int memoryMB;               /* -m option */
+  int replacement;            /* -R option, REPLACE_ policy */
+  int memoLeft;               /* -T option */
+  int exactCover;             /* -e dlx */
+  char *sequenceArg;          /* -S option */
+  char *sequenceFileName;     /* -i option */
+  char *decodeFileName;       /* -D option */
+  char *reportFileName;       /* -J option */
+  double progressInterval;    /* -P option, seconds (0 = no report) */
+  int census;                 /* -G option */
+  long probes;                /* -t option, probes of the estimate (0 = search) */
+  uint64_t probeSeed;
+  int best;                   /* -B option, BEST_ goal (0 = all the solutions) */
+  int bestCount;              /* -K option */
+  char *checkpointFileName;   /* -C option */
+  double checkpointInterval;  /* seconds between two checkpoints */
+  char *resumeFileName;       /* -r option */
+  int pieces;                 /* -x option */
   int verbose;                /* -v option */
   int help;                   /* -h option */
 } globalArgs;
 
-static const char *optString = "i:hv?";
+static const char *optString = "o:sE:cb:M:n:L:j:d:S:i:D:p:m:R:T:e:J:P:Gt:B:K:C:r:x:hv?";
+
+/* Lengths of the elements of the puzzle, counting the joints at both ends
+ * (the 3x3x3 snake cube unless -S or -i give another one) */
+int snakeCube[] = { 3, 3, 3, 3, 2, 2, 2, 3, 3, 2, 2, 3, 2, 3, 2, 2, 3 };
+int *Sequence = snakeCube;
+int nbElements = sizeof (snakeCube) / sizeof (int);
+
+/* Sequences read with -i, solved one after the other */
+int **sequences;
+int *sequenceLengths;
+int nbSequences;
+
+/* Feasibility checks of -p, in the order they are tried */
+#define PRUNE_PARITY    1     /* p: colours of the box against the walk */
+#define PRUNE_DEAD      2     /* d: empty cells that cannot be walked through */
+#define PRUNE_REACH     4     /* r: empty cells out of reach of the walk */
+#define NB_PRUNE_RULES  3
+static const char pruneChar[] = "pdr";
+static const char *pruneName[] = { "parity", "dead cells", "reachability" };
+
+/* Goals of the branch and bound (-B) */
+#define BEST_MIN        1     /* min: fewest contacts */
+#define BEST_MAX        2     /* max: most contacts, the most compact folds */
+
+/* Replacement policies of the counting table (-R) */
+#define REPLACE_TWO     0     /* two: a slot kept for the biggest subtree, one always replaced */
+#define REPLACE_ALWAYS  1     /* always: one slot, always replaced */
+#define REPLACE_DEPTH   2     /* depth: one slot, replaced by a bigger subtree only */
+static const char *replaceName[] = { "two", "always", "depth" };
+
+/* Subtree counted by the memoized search (-m): the state of the walk it
+ * starts from, and its solutions */
+struct memoEntry_t {
+  uint64_t occupied;
+  uint64_t state;             /* 0 for an empty slot */
+  long solutions;
+};
 
 struct coordinates_t {
   int x;
@@ -21,33 +94,353 @@ struct coordinates_t {
   int z;
 };
 
+/* Element of the walk on the search stack */
+struct frame_t {
+  struct coordinates_t min;   /* Bounding box before the element */
+  struct coordinates_t max;
+  int dir;                    /* Direction the element was walked in */
+  int contacts;               /* Contacts before the element */
+  char children[4];           /* Directions of the next element */
+  int nbChildren;
+  int next;                   /* Child to try next */
+  uint64_t state;             /* State counted in the table (-m), 0 if none */
+  long solutions;             /* Solutions before the element */
+};
+
+/* What happened to the directions tried for an element */
+struct depthCount_t {
+  long nodes;                 /* Walked */
+  long outOfBox;              /* Out of the bounding box */
+  long overlaps;              /* Onto a cell of the walk */
+};
+
+/* Energy landscape (-E): the nodes walked by element (row) and contacts
+ * (column), then two rows of the solutions and of their folds by contacts.
+ * The columns are added as more contacts are met. */
+struct energy_t {
+  long * counts;              /* nbElements + 2 rows of stride columns */
+  int stride;
+};
+
+/* Bits of a grid of up to 6x6x6 cells, for the checks of -p. The words
+ * used are the ones of the side, so that a search compiled for a side of
+ * 4 or less works on one word and one for 5 or 6 on two or four, in SIMD
+ * registers where the compiler finds them. */
+#define GRID_SIDE_MAX   6
+#define GRID_WORDS_MAX  4
+#define GRID_WORDS(side) ( ( (side) * (side) * (side) + 63 ) / 64 )
+typedef struct {
+  uint64_t w[GRID_WORDS_MAX];
+} grid_t;
+
 struct HamiltonianWalk_t {
+  int * seq;                  /* Sequence being folded */
+  int nbElements;
+  int dims[3];                /* Sides of the bounding box, from the shortest */
+  int box;                    /* Longest side of the bounding box, 0 for none */
+  int cubic;                  /* All the sides are the same */
+  int reversible;             /* The sequence reads the same from both ends */
   struct coordinates_t * coord;
   int length;
   int MAX_length;
   int last_element;
   int last_direction;
   int solutions;
+  long nodes;                 /* Elements walked */
+  struct depthCount_t * depth;/* By element */
+  struct timespec started;    /* When the search began (wall clock) */
+  double firstSolution;       /* Seconds to the first solution, -1 if none */
+  int contacts;               /* Neighbours not next in the chain (-E, -B) */
+  struct energy_t energy;     /* Of the nodes counted (-E) */
+  struct coordinates_t min;
+  struct coordinates_t max;
+  uint64_t * occupied;        /* One bit per cell of the grid */
+  int side;                   /* Cells per side of the grid */
+  int * wrap;                 /* Coordinate modulo side, from -MAX_length */
+  char * dirs;                /* Direction each element was walked in */
+  int frontier;               /* Element where the walk is cut into tasks */
+  const char * path;          /* Directions to follow up to element pathEnd */
+  int pathEnd;
+  int pathCounted;            /* Last element of the path counted before */
+  struct frame_t * stack;     /* Frame of each element, from the second */
+  struct task_t * task;       /* Task being searched by this thread */
+  long orbits[49];            /* Solutions by the size of their orbit */
+  int prune;                  /* -p checks that apply to this walk */
+  grid_t layer[3][GRID_SIDE_MAX]; /* Cells of the grid by coordinate, per axis */
+  grid_t cells;               /* All the cells of the grid */
+  long cuts[NB_PRUNE_RULES];  /* Nodes cut by each check */
+  int memo;                   /* Subtrees are counted in the table (-m) */
+  struct memoEntry_t * table; /* Buckets of two slots, allocated when used */
+  uint64_t buckets;
+  long lookups;
+  long hits;
+};
+
+/* Each search thread walks its own copy */
+__thread struct HamiltonianWalk_t hm;
+
+/* Subtree of the search handed to the threads of the parallel search.
+ * Its solutions are kept until all the tasks before it are written. */
+struct task_t {
+  char * path;                /* Directions of the elements before the cut */
+  int pathEnd;                /* Last element of the path */
+  int counted;                /* Last element of the path counted before */
+  int solutions;
+  FILE * buffer;              /* CSV of the solutions */
+  char * text;
+  size_t size;
+  long * ends;                /* Where each solution ends in text */
+  int nbEnds;
+  long orbits[49];            /* Solutions by the size of their orbit */
+  unsigned char * orbit;      /* Orbit of each solution, with -M */
+  struct energy_t energy;     /* With -E */
+  long nodes;
+  int done;
+};
+
+/* Tasks of a thread, taken from the head by the thread and from the tail by
+ * the others */
+struct taskQueue_t {
+  pthread_mutex_t lock;
+  int * tasks;
+  int head;
+  int tail;
+};
+
+struct search_t {
+  struct task_t * tasks;
+  int nbTasks;
+  int maxTasks;
+  struct taskQueue_t * queues;
+  pthread_mutex_t streamLock; /* Protects the fields below */
+  int next;                   /* First task not written yet */
+  int written;                /* Solutions written */
+  long orbits[49];            /* Of the solutions written */
+  struct energy_t energy;     /* Of the tasks written */
+  long nodes;
+  long cuts[NB_PRUNE_RULES];
+  long lookups;
+  long hits;
+  struct depthCount_t * depth;
+  int finished;               /* Tasks searched */
+  struct timespec started;
+  double firstSolution;       /* Earliest of the threads */
+} search;
+
+/* Batch mode: the sequences of -i are taken in turn by the threads, and the
+ * summary of each one is written once all the ones before it are */
+struct batchResult_t {
+  int solutions;
+  long nodes;
+  double secs;
+  double firstSolution;
+  int done;
+};
+
+struct batch_t {
+  pthread_mutex_t lock;       /* Protects the fields below */
+  int next;                   /* First sequence not taken yet */
+  int written;                /* Summaries written */
+  struct batchResult_t * results;
+  long nodes;                 /* Of the sequences finished */
+  int finished;
+} batch;
+
+/* Sequence found by the census (-G), with its folds */
+struct censusEntry_t {
+  unsigned char * seq;        /* Lengths of the elements, NULL for an empty slot */
+  int nbElements;
+  long folds;
+};
+
+/* Sequences of the census found by a thread, in a hash table with open
+ * addressing */
+struct censusTable_t {
+  struct censusEntry_t * entries;
+  long size;                  /* A power of two */
+  long used;
+  long paths;                 /* Paths walked to the end */
+};
+
+/* Step of a path of the census: the bounding box before it, its direction
+ * (in dirChar) and the next direction to try from its cell */
+struct censusStep_t {
   struct coordinates_t min;
   struct coordinates_t max;
-} hm;
+  int dir;
+  int next;
+};
+
+struct census_t {
+  struct censusTable_t * tables; /* Of each thread */
+  long paths;
+  long sequences;
+  long unique;                /* Sequences of a single fold */
+} census;
+
+/* Start of the run, for the wall time of -J */
+struct timespec wallStart;
+
+/* Progress report (-P): a timer thread reads the counters of the walk of
+ * every search thread */
+struct progress_t {
+  pthread_t timer;
+  pthread_mutex_t lock;       /* Protects walkers, and the counters while
+                                 they are moved from a walk to the totals */
+  pthread_cond_t wake;
+  int stopped;
+  struct HamiltonianWalk_t ** walkers;
+  int nbWalkers;
+} progress;
+
+/* Folds kept by the branch and bound (-B), the best first. It runs on one
+ * thread. */
+struct best_t {
+  int * contacts;
+  char * dirs;                /* The directions of the elements of each fold */
+  int nbFolds;
+  int maxContacts;            /* Most contacts a fold can have in the box */
+  long cuts;                  /* Nodes cut by the bound */
+} best;
+
+/* Checkpoints (-C): a timer thread stops the search threads where they
+ * stand and writes the frontier of the search */
+struct checkpoint_t {
+  pthread_t timer;
+  pthread_mutex_t lock;       /* Protects the fields below */
+  pthread_cond_t wake;        /* Wakes the timer */
+  pthread_cond_t resume;      /* Wakes the search threads */
+  volatile int requested;     /* The search threads stop at their next node */
+  int stopped;                /* Search threads stopped */
+  int running;                /* Search threads not finished */
+  int ended;
+  long output;                /* Bytes of the -o stream at the checkpoint
+                                 resumed, -1 for none */
+  long nodes;                 /* Nodes of the checkpoint resumed, left out
+                                 of the rates of this run */
+} checkpoint;
+
+/* Set once -M solutions are written, makes all the threads return */
+volatile int searchStopped = 0;
+
+/* Newick tree (-n), written through a buffer of its own. The branch
+ * lengths only depend on the element, so they are formatted once. */
+struct newick_t {
+  char buffer[1 << 16];
+  int used;
+  char (*lengths)[16];        /* ":0.037" of each element */
+  int * lengthSizes;
+  int limit;                  /* Deepest element written, below it subtrees
+                                 are collapsed into their solution count */
+  int collapsedFrom;          /* Solutions before the subtree collapsed */
+} newick;
+
+/*
+ * Symmetries of the cube: the 48 maps of the directions that permute the
+ * axes and flip their signs (24 rotations and 24 reflections).
+ * Directions are numbered 2*axis + sign as in dirChar.
+ */
+static const char dirChar[] = "XxYyZz";
+int symmetry[48][6];
+int nbSymmetries;           /* 24 with -s (rotations only), 48 otherwise */
+
  
 
 /* Headers */
 /** Prints the Hamiltonian walk to a coordinates file */
 void printCSV (int seq[], FILE * fh);
 void print_hm ();
-/** Counts the number of contacts in the structure */
+/** Counts the number of contacts in the structure, from scratch */
 int countContacts ();
-/** Creates a node with coordinates and checks for size/overlap */
-void createNode(int direction);
+/** Walks the elements after the first two, in every direction allowed */
+void searchFromRoot();
+/** Walks the next element in a direction if it fits. Returns 1 if it does. */
+static inline int placeElement(int direction, const int side);
+/** Handles a node just walked to (solution, cut...). Returns 1 if its
+ * children have to be searched, otherwise the node is already taken back. */
+static inline int expandNode(const int side);
+/** Takes the last element out of the walk */
+static inline void removeElement(const int side);
+/** Estimates the size of the search with the probes of -t */
+void estimateSearch();
+/** Sets the bound of -B for the walk in hm */
+void initBest();
+/** Keeps the fold in hm if it is among the best of -B */
+static void keepFold();
+/** Checks if no fold below the walk in hm can be kept by -B any more */
+static inline int boundCut();
+/** Prints the folds kept by -B, the best first */
+void printBest();
+/** Writes the histogram of -E as CSV */
+void writeEnergy(FILE *f, const struct energy_t *h);
+/** Searches with globalArgs.threads threads. Returns the solutions found. */
+int parallelSearch();
+/** Reads the checkpoint of -r: sequence, box, counts and frontier */
+void readCheckpoint(const char *fileName);
+/** Deals the frontier of the checkpoint read into n checkpoints */
+void splitCheckpoint(const char *fileName, int n);
+/** Stops a search thread until the checkpoint is written */
+static void checkpointStop();
+/** Starts the timer of the checkpoints of -C */
+static void startCheckpoints();
+/** Stops the timer and writes the last checkpoint */
+static void stopCheckpoints();
+/** Solves the sequences read with -i, one summary line each */
+void batchSearch();
+/** Prints the sequences that fold into the box of -b, with their folds */
+void censusSearch();
+/** Reads a sequence like "3,3,2,2", returns its number of elements */
+int parseSequence(const char *text, int **seq);
+/** Reads the sequences of a file, one per line */
+void readSequences(const char *fileName);
+/** Reads a box like "4" or "2x3x4" into its sides, from the shortest.
+ * Returns -1 if it is not one. */
+int parseBox(const char *text, int box[3]);
+/** Sides of the bounding box for a sequence. Returns -1 if it does not fit
+ * in the box of -b. */
+int sequenceBox(int *seq, int n, int box[3]);
+/** Writes the solution in hm, as CSV or as a record of the stream (-o) */
+void writeSolution(FILE *f);
+/** Writes the header of the solution stream */
+void writeStreamHeader(FILE *f, int *seq, int n);
+/** Prints the solutions of a stream as CSV */
+void decodeStream(const char *fileName);
+/** Walks hm from the origin in the directions of hm.dirs */
+void walkDirections();
+/** Solves the sequence in hm as an exact cover problem (-e dlx) */
+void solveExactCover();
+/** Checks if the walk in hm has to fill its bounding box */
+int fillsBox();
+/** Saves the walk up to the cut as a task of the parallel search */
+void addTask();
 /** initialises first two elements of puzzle */
-void init_hm ( int * seq, int volume );
+void init_hm ( int * seq, int nbElements, const int box[3] );
+static void initGrid();
 void destroy_hm();
 /** Checks if a number is a perfect cube */
 int is_perfect_cube(int);
+/** Fills symmetry[] */
+void init_symmetries();
+/** Orbit size of the solution in hm, 0 if it is a copy of another one */
+int solutionOrbit();
+static inline void setChildren(struct frame_t *f);
+static inline void childDone(struct frame_t *f);
 /** Checks if there was a z dimension step already */
 int walked_in_z();
+/** Formats the branch lengths of the Newick tree */
+void init_newick();
+/** Writes what is left in the Newick buffer */
+void flushNewick();
+/** Appends the summary of the run to the -J file, as a JSON object */
+void writeReport(const char *input, int sequences, long solutions, long nodes,
+                 double firstSolution, int unsolved, clock_t start);
+/** Starts the timer thread of -P, for that many search threads */
+void startProgress(int nbWalkers);
+/** Stops the timer thread of -P */
+void stopProgress();
+/** Makes the walk of a search thread seen by the timer thread (NULL when it
+ * ends) */
+void registerWalk(int id, struct HamiltonianWalk_t *w);
 /** Prints help message */
 void usage(char*);
 
@@ -55,6 +448,7 @@ void usage(char*);
 int main ( int argc, char *argv[] )
 {
   clock_t start = clock();
+  clock_gettime( CLOCK_MONOTONIC, &wallStart );
   /****************************/
   /* Parse cmd line arguments */
   /****************************/
@@ -67,10 +461,33 @@ int main ( int argc, char *argv[] )
   globalArgs.newickFileName = NULL;  /* Newick string output file name */
   globalArgs.newickFile = NULL;      /* Newick output FILE handle */
   globalArgs.countOnly = 0;          /* Counts solutions, no output */
-  globalArgs.boundingBox = -1;       /* Limits the structure to a cube of this size
+  globalArgs.boundingBox[0] = -1;    /* Limits the structure to a box of these sides
                                          0 = infinite
                                         -1 = cuberoot of length of sequence (cube)   */
   globalArgs.maxSolutions = 0;       /* Limits the number of solutions (0 = no limit) */
+  globalArgs.threads = 1;            /* Search threads */
+  globalArgs.splitDepth = 6;         /* Elements walked before the tree is split */
+  globalArgs.newickDepth = 0;        /* Elements of the Newick tree (0 = all) */
+  globalArgs.pruning = 0;            /* Feasibility checks */
+  globalArgs.memoryMB = 0;           /* Memory of the counting table (0 = none) */
+  globalArgs.replacement = REPLACE_TWO;
+  globalArgs.memoLeft = 28;          /* Elements left below which the table is not used */
+  globalArgs.exactCover = 0;         /* Solver: DFS, or exact cover */
+  globalArgs.sequenceArg = NULL;     /* Sequence to fold */
+  globalArgs.sequenceFileName = NULL;/* File of sequences to fold */
+  globalArgs.decodeFileName = NULL;  /* Solution stream to print as CSV */
+  globalArgs.reportFileName = NULL;  /* JSON summary of the run */
+  globalArgs.progressInterval = 0;   /* Seconds between progress reports */
+  globalArgs.census = 0;             /* Sequences that fold into the box */
+  globalArgs.probes = 0;             /* Estimates the search instead */
+  globalArgs.probeSeed = 1;
+  globalArgs.best = 0;               /* Keeps the folds of extreme contacts */
+  globalArgs.bestCount = 1;          /* Folds kept */
+  globalArgs.checkpointFileName = NULL; /* Frontier of the search, saved */
+  globalArgs.checkpointInterval = 600;
+  globalArgs.resumeFileName = NULL;  /* Checkpoint to resume */
+  globalArgs.pieces = 0;             /* Pieces the checkpoint is split into */
+  checkpoint.output = -1;
   globalArgs.verbose = 0;            /* Prints heaps of stuff */
 
   int index;
@@ -96,18 +513,11 @@ int main ( int argc, char *argv[] )
         globalArgs.countOnly = 1;
         break;
       case 'b':
-        globalArgs.boundingBox = strtol( optarg, &ptr, 0);
-        if ( !( globalArgs.boundingBox ) && !( strcmp( optarg, ptr ) ) )
+        if ( parseBox( optarg, globalArgs.boundingBox ) )
         {
-          fprintf(stderr, "Argument for option -b has to be a non-negative integer or 0\n");
+          fprintf(stderr, "Argument for option -b has to be a side, sides like 2x3x4, or 0\n");
           exit(EXIT_FAILURE);
         }
-        if ( globalArgs.boundingBox < 0 )
-        {
-          fprintf(stderr, "Argument for option -b cannot be negative\n");
-          exit(EXIT_FAILURE);
-        }
-        ptr = NULL;
         break;
       case 'M':
         globalArgs.maxSolutions = strtol( optarg, &ptr, 0);
@@ -126,6 +536,163 @@ int main ( int argc, char *argv[] )
       case 'n':
         globalArgs.newickFileName = optarg;
         break;
+      case 'L':
+        globalArgs.newickDepth = strtol( optarg, &ptr, 0);
+        if ( *ptr || globalArgs.newickDepth < 1 )
+        {
+          fprintf(stderr, "Argument for option -L has to be a positive integer\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
+      case 'j':
+        globalArgs.threads = strtol( optarg, &ptr, 0);
+        if ( *ptr || globalArgs.threads < 1 )
+        {
+          fprintf(stderr, "Argument for option -j has to be a positive integer\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
+      case 'd':
+        globalArgs.splitDepth = strtol( optarg, &ptr, 0);
+        if ( *ptr || globalArgs.splitDepth < 1 )
+        {
+          fprintf(stderr, "Argument for option -d has to be a positive integer\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
+      case 'S':
+        globalArgs.sequenceArg = optarg;
+        break;
+      case 'i':
+        globalArgs.sequenceFileName = optarg;
+        break;
+      case 'D':
+        globalArgs.decodeFileName = optarg;
+        break;
+      case 'J':
+        globalArgs.reportFileName = optarg;
+        break;
+      case 'P':
+        globalArgs.progressInterval = strtod( optarg, &ptr );
+        if ( *ptr || ! ( globalArgs.progressInterval > 0 ) )
+        {
+          fprintf(stderr, "Argument for option -P has to be a positive number of seconds\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
+      case 'p':
+        for ( ptr = optarg; *ptr; ptr++ )
+        {
+          char *rule = strchr( pruneChar, *ptr );
+          if ( ! rule )
+          {
+            fprintf(stderr, "Argument for option -p has to be made of the letters %s\n", pruneChar);
+            exit(EXIT_FAILURE);
+          }
+          globalArgs.pruning |= 1 << ( rule - pruneChar );
+        }
+        ptr = NULL;
+        break;
+      case 'm':
+        globalArgs.memoryMB = strtol( optarg, &ptr, 0);
+        if ( *ptr || globalArgs.memoryMB < 1 )
+        {
+          fprintf(stderr, "Argument for option -m has to be a positive integer (MB)\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
+      case 'T':
+        globalArgs.memoLeft = strtol( optarg, &ptr, 0);
+        if ( *ptr || globalArgs.memoLeft < 0 )
+        {
+          fprintf(stderr, "Argument for option -T has to be a positive integer or 0\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
+      case 'R':
+        for ( globalArgs.replacement = 0; globalArgs.replacement < 3; globalArgs.replacement++ )
+          if ( ! strcmp( optarg, replaceName[ globalArgs.replacement ] ) )
+            break;
+        if ( globalArgs.replacement == 3 )
+        {
+          fprintf(stderr, "Argument for option -R has to be two, always or depth\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'e':
+        if ( strcmp( optarg, "dfs" ) && strcmp( optarg, "dlx" ) )
+        {
+          fprintf(stderr, "Argument for option -e has to be dfs or dlx\n");
+          exit(EXIT_FAILURE);
+        }
+        globalArgs.exactCover = ! strcmp( optarg, "dlx" );
+        break;
+      case 'G':
+        globalArgs.census = 1;
+        break;
+      case 't':
+        globalArgs.probes = strtol( optarg, &ptr, 0 );
+        if ( *ptr == ',' )
+          globalArgs.probeSeed = strtoull( ptr + 1, &ptr, 0 );
+        if ( *ptr || globalArgs.probes < 1 )
+        {
+          fprintf(stderr, "Argument for option -t has to be a positive number of probes, "
+                          "and a seed as in 10000,7\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
+      case 'B':
+        if ( strcmp( optarg, "min" ) && strcmp( optarg, "max" ) )
+        {
+          fprintf(stderr, "Argument for option -B has to be min or max\n");
+          exit(EXIT_FAILURE);
+        }
+        globalArgs.best = strcmp( optarg, "min" ) ? BEST_MAX : BEST_MIN;
+        break;
+      case 'K':
+        globalArgs.bestCount = strtol( optarg, &ptr, 0 );
+        if ( *ptr || globalArgs.bestCount < 1 )
+        {
+          fprintf(stderr, "Argument for option -K has to be a positive integer\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
+      case 'C':
+        globalArgs.checkpointFileName = optarg;
+        ptr = strrchr( optarg, ',' );
+        if ( ptr )
+        {
+          *ptr++ = '\0';
+          globalArgs.checkpointInterval = strtod( ptr, &ptr );
+        }
+        if ( ! *optarg || ( ptr && *ptr ) || ! ( globalArgs.checkpointInterval > 0 ) )
+        {
+          fprintf(stderr, "Argument for option -C has to be a file, and a positive number of "
+                          "seconds between checkpoints as in run.ck,3600\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
+      case 'r':
+        globalArgs.resumeFileName = optarg;
+        break;
+      case 'x':
+        globalArgs.pieces = strtol( optarg, &ptr, 0 );
+        if ( *ptr || globalArgs.pieces < 1 )
+        {
+          fprintf(stderr, "Argument for option -x has to be a positive integer\n");
+          exit(EXIT_FAILURE);
+        }
+        ptr = NULL;
+        break;
       case 'v':
         globalArgs.verbose = 1;
         break;
@@ -137,11 +704,13 @@ int main ( int argc, char *argv[] )
           fprintf(stderr, "Option -%c requires an argument.\n", optopt);
         else if (optopt == 'E')
           fprintf(stderr, "Option -%c requires an argument.\n", optopt);
-        else if (optopt == 'n')
+        else if ( optopt == 'n' || optopt == 'S' || optopt == 'i' || optopt == 'D' || optopt == 'p' || optopt == 'R'
+                  || optopt == 'e' || optopt == 'J' || optopt == 'B' || optopt == 'C' || optopt == 'r' )
           fprintf(stderr, "Option -%c requires an argument.\n", optopt);
         else if (optopt == 'b')
           fprintf(stderr, "Option -%c requires an integer.\n", optopt);
-        else if ( optopt == 'M')
+        else if ( optopt == 'M' || optopt == 'j' || optopt == 'd' || optopt == 'L' || optopt == 'm' || optopt == 'T'
+                  || optopt == 'P' || optopt == 't' || optopt == 'K' || optopt == 'x' )
           fprintf(stderr, "Option -%c requires an integer.\n", optopt);
         else if (isprint (optopt))
           fprintf(stderr, "Unknown option '-%c'.\n", optopt);
@@ -155,6 +724,62 @@ int main ( int argc, char *argv[] )
     }
   if ( globalArgs.countOnly ) // -c option overrides solutions output
     globalArgs.output = 0;
+  if ( globalArgs.memoryMB && ( ! globalArgs.countOnly || globalArgs.maxSolutions
+                               || globalArgs.energyFileName || globalArgs.newickFileName ) )
+  {
+    fprintf(stderr, "The table of -m counts whole subtrees and needs -c, without -M, -E or -n\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( globalArgs.exactCover && ( globalArgs.energyFileName || globalArgs.newickFileName || globalArgs.memoryMB ) )
+  {
+    fprintf(stderr, "The exact cover engine has no search tree for -E, -n or -m\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( globalArgs.threads > 1 && globalArgs.newickFileName )
+  {
+    fprintf(stderr, "The Newick tree of -n follows the search node by node and needs -j 1\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( globalArgs.probes && ( globalArgs.outFileName || globalArgs.energyFileName || globalArgs.newickFileName
+                              || globalArgs.memoryMB || globalArgs.exactCover || globalArgs.maxSolutions
+                              || globalArgs.census ) )
+  {
+    fprintf(stderr, "The estimate of -t probes the tree of the search, without -o, -E, -n, -m, -e dlx, -M or -G\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( globalArgs.probes )
+    globalArgs.output = 0;
+  if ( globalArgs.best && ( globalArgs.energyFileName || globalArgs.newickFileName || globalArgs.memoryMB
+                            || globalArgs.exactCover || globalArgs.maxSolutions || globalArgs.census
+                            || globalArgs.probes || globalArgs.threads > 1 ) )
+  {
+    fprintf(stderr, "The branch and bound of -B keeps its best folds on one thread, "
+                    "without -E, -n, -m, -e dlx, -M, -G, -t or -j\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( globalArgs.bestCount > 1 && ! globalArgs.best )
+  {
+    fprintf(stderr, "Option -K gives the number of folds kept by -B\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( ( globalArgs.checkpointFileName || globalArgs.resumeFileName )
+       && ( globalArgs.newickFileName || globalArgs.maxSolutions || globalArgs.best
+            || globalArgs.census || globalArgs.probes || globalArgs.exactCover ) )
+  {
+    fprintf(stderr, "The checkpoints of -C and -r save the search of the solutions, "
+                    "without -n, -M, -B, -G, -t or -e dlx\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( globalArgs.resumeFileName && ( globalArgs.sequenceArg || globalArgs.sequenceFileName ) )
+  {
+    fprintf(stderr, "A search resumed with -r folds the sequence of its checkpoint, without -S or -i\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( globalArgs.pieces && ! globalArgs.resumeFileName )
+  {
+    fprintf(stderr, "Option -x splits the checkpoint of -r\n");
+    exit(EXIT_FAILURE);
+  }
 
   for (index = optind; index < argc; index++)
   {
@@ -163,34 +788,177 @@ int main ( int argc, char *argv[] )
     exit(EXIT_FAILURE);
   }
 
+  if ( globalArgs.decodeFileName )
+  {
+    decodeStream( globalArgs.decodeFileName );
+    exit(EXIT_SUCCESS);
+  }
+
+  if ( globalArgs.census )
+  {
+    int i;
+    int *b = globalArgs.boundingBox;
+    if ( globalArgs.sequenceArg || globalArgs.sequenceFileName || globalArgs.outFileName || globalArgs.energyFileName
+         || globalArgs.newickFileName || globalArgs.memoryMB || globalArgs.exactCover || globalArgs.maxSolutions )
+    {
+      fprintf(stderr, "The census of -G walks the box of -b, without -S, -i, -o, -E, -n, -m, -e dlx or -M\n");
+      exit(EXIT_FAILURE);
+    }
+    if ( b[0] < 1 || b[0] * b[1] * b[2] < 4 || b[2] > 255 )
+    {
+      fprintf(stderr, "The census of -G needs a box of 4 cells or more given with -b, up to 255 per side\n");
+      exit(EXIT_FAILURE);
+    }
+    init_symmetries();
+    startProgress( globalArgs.threads );
+    censusSearch();
+    stopProgress();
+    clock_t end = clock();
+    fprintf(stderr, "Paths = %ld\n", census.paths);
+    fprintf(stderr, "Folds = %d\n", search.written);
+    fprintf(stderr, "Sequences = %ld, with a single fold = %ld\n", census.sequences, census.unique);
+    fprintf(stderr, "Nodes = %ld\n", search.nodes);
+    for ( i = 0; i < NB_PRUNE_RULES; i++ )
+      if ( globalArgs.pruning & ( 1 << i ) )
+        fprintf (stderr, "  cut by %s: %ld\n", pruneName[i], search.cuts[i]);
+    fprintf(stderr, "Time elapsed = %d (%.3f secs)\n", (int) (end - start), (float) (end - start) / CLOCKS_PER_SEC);
+    if ( end > start )
+      fprintf(stderr, "Nodes per second = %.0f\n", (double) search.nodes * CLOCKS_PER_SEC / ( end - start ));
+    if ( globalArgs.reportFileName )
+      writeReport( "census", census.sequences, search.written, search.nodes, search.firstSolution,
+                   0, start );
+    exit(EXIT_SUCCESS);
+  }
+
+  if ( globalArgs.resumeFileName )
+  {
+    readCheckpoint( globalArgs.resumeFileName );
+    if ( globalArgs.pieces )
+    {
+      splitCheckpoint( globalArgs.resumeFileName, globalArgs.pieces );
+      exit(EXIT_SUCCESS);
+    }
+  }
+
+  if ( globalArgs.sequenceArg && globalArgs.sequenceFileName )
+  {
+    fprintf(stderr, "Options -S and -i cannot be used together\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( globalArgs.sequenceArg )
+  {
+    nbElements = parseSequence( globalArgs.sequenceArg, &Sequence );
+    if ( nbElements < 0 )
+    {
+      fprintf(stderr, "Argument for option -S has to be a list of 3 or more lengths of at least 2\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if ( globalArgs.sequenceFileName )
+  {
+    readSequences( globalArgs.sequenceFileName );
+    Sequence = sequences[0];
+    nbElements = sequenceLengths[0];
+  }
+
+  if ( nbSequences > 1 && ( globalArgs.probes || globalArgs.best || globalArgs.checkpointFileName ) )
+  {
+    fprintf(stderr, "The estimate of -t, the branch and bound of -B and the checkpoints of -C "
+                    "need a single sequence\n");
+    exit(EXIT_FAILURE);
+  }
+  if ( nbSequences > 1 )
+  {
+    /* Batch mode: counts only, a summary line per sequence */
+    if ( globalArgs.outFileName || globalArgs.energyFileName || globalArgs.newickFileName )
+    {
+      fprintf(stderr, "Options -o, -E and -n need a single sequence\n");
+      exit(EXIT_FAILURE);
+    }
+    globalArgs.output = 0;
+    init_symmetries();
+    startProgress( globalArgs.threads );
+    batchSearch();
+    stopProgress();
+    clock_t end = clock();
+    fprintf(stderr, "Sequences = %d\n", nbSequences);
+    fprintf(stderr, "Time elapsed = %d (%.3f secs)\n", (int) (end - start), (float) (end - start) / CLOCKS_PER_SEC);
+    if ( globalArgs.reportFileName )
+    {
+      long solutions = 0, nodes = 0;
+      double firstSolution = 0;
+      int k, unsolved = 0;
+      for ( k = 0; k < nbSequences; k++ )
+      {
+        solutions += batch.results[k].solutions;
+        nodes += batch.results[k].nodes;
+        if ( batch.results[k].firstSolution < 0 )
+          unsolved++;
+        else
+          firstSolution += batch.results[k].firstSolution;
+      }
+      if ( unsolved < nbSequences )
+        firstSolution /= nbSequences - unsolved;
+      else
+        firstSolution = -1;
+      writeReport( globalArgs.sequenceFileName, nbSequences, solutions, nodes, firstSolution, unsolved, start );
+    }
+    free( batch.results );
+    exit(EXIT_SUCCESS);
+  }
+
   /*********************/
   /* Declare variables */
   /*********************/
 
   int i = 0;
   int cubeSide = 0;
-  int nbElements = sizeof (Sequence) / sizeof (int);
   int structureLength = 1;
   for (i = 0; i < nbElements; i++)
     structureLength += Sequence[i] - 1;
 
   if ( ! is_perfect_cube(structureLength) )
   {
-    fprintf(stderr, "WARNING: The sequence provided cannot fold into a perfect cube\n");
+    if ( globalArgs.boundingBox[0] == -1 )
+      fprintf(stderr, "WARNING: The sequence provided cannot fold into a perfect cube\n");
     cubeSide = ceil( cbrt(structureLength) );
   }
   else
     cubeSide = (int) cbrt(structureLength);
   
-  if ( globalArgs.boundingBox == -1 )
-    globalArgs.boundingBox = cubeSide;
-  else
-    if ( globalArgs.boundingBox && pow( globalArgs.boundingBox, 3 ) < structureLength )
+  if ( sequenceBox( Sequence, nbElements, globalArgs.boundingBox ) )
+  {
+    fprintf(stderr, "The sequence provided does not fit into the bounding box. "
+                    "It has %d cells\n", structureLength);
+    exit(EXIT_FAILURE);
+  }
+
+  if ( globalArgs.outFileName && globalArgs.output && checkpoint.output >= 0 )
+  {
+    /* Resumed: the stream goes on from where the checkpoint left it */
+    globalArgs.outFile = fopen(globalArgs.outFileName, "r+");
+    if ( ! globalArgs.outFile || fseek( globalArgs.outFile, 0, SEEK_END )
+         || ftell( globalArgs.outFile ) < checkpoint.output
+         || ftruncate( fileno( globalArgs.outFile ), checkpoint.output )
+         || fseek( globalArgs.outFile, checkpoint.output, SEEK_SET ) )
+    {
+      fprintf(stderr, "Could not go on with %s from the %ld bytes of the checkpoint\n",
+              globalArgs.outFileName, checkpoint.output);
+      exit(EXIT_FAILURE);
+    }
+    setvbuf( globalArgs.outFile, NULL, _IOFBF, 1 << 20 );
+  }
+  else if ( globalArgs.outFileName && globalArgs.output )
+  {
+    globalArgs.outFile = fopen(globalArgs.outFileName, "w");
+    if ( ! globalArgs.outFile )
     {
-      fprintf(stderr, "The sequence provided does not fit into the bounding box. "
-                      "It has to be at least %d\n", cubeSide);
+      fprintf(stderr, "Could not open %s to write\n", globalArgs.outFileName);
       exit(EXIT_FAILURE);
     }
+    setvbuf( globalArgs.outFile, NULL, _IOFBF, 1 << 20 );
+    writeStreamHeader( globalArgs.outFile, Sequence, nbElements );
+  }
 
   if ( globalArgs.energyFileName )
   {
@@ -225,441 +993,3211 @@ int main ( int argc, char *argv[] )
     fprintf( stderr, " - Newick tree file: %s\n", globalArgs.newickFileName?globalArgs.newickFileName:"NULL");
     fprintf( stderr, " - Newick file handle open? %s\n", globalArgs.newickFile?"YES":"NO");
     fprintf( stderr, " - Only count: %s\n", globalArgs.countOnly?"YES":"NO");
-    fprintf( stderr, " - Bounding box: %d\n", globalArgs.boundingBox);
-    fprintf( stderr, " - Max solutions to return: %d\n\n", globalArgs.maxSolutions);
+    fprintf( stderr, " - Bounding box: %dx%dx%d\n", globalArgs.boundingBox[0],
+             globalArgs.boundingBox[1], globalArgs.boundingBox[2]);
+    fprintf( stderr, " - Max solutions to return: %d\n", globalArgs.maxSolutions);
+    fprintf( stderr, " - Threads: %d (split after %d elements)\n\n", globalArgs.threads, globalArgs.splitDepth);
     fprintf( stderr, "Cube Side=%d\n", cubeSide);
-    fprintf( stderr, "Bounding box=%d\n", globalArgs.boundingBox);
   }
 
   /*********************************************************************/
   /* Initialise the Hamiltonian walk structure with first two elements */
   /*********************************************************************/
 
-  init_hm( Sequence, structureLength );
+  init_hm( Sequence, nbElements, globalArgs.boundingBox );
+  init_symmetries();
+  if ( globalArgs.newickFile )
+    init_newick();
+
+  if ( globalArgs.probes )
+  {
+    estimateSearch();
+    destroy_hm();
+    exit(EXIT_SUCCESS);
+  }
+  if ( globalArgs.best )
+    initBest();
 
   /**************************/
   /* Enter recursive search */
   /**************************/
 
-  if ( globalArgs.newickFile )
-    fprintf( globalArgs.newickFile, "(" );
-  createNode('X');
-  if ( globalArgs.newickFile )
-    fprintf( globalArgs.newickFile, "+x:%.3f,", (float) Sequence[ (hm.last_element)+1 ] / structureLength );
-  createNode('x');
-  if ( globalArgs.newickFile )
-    fprintf( globalArgs.newickFile, "-x:%.3f,", (float) Sequence[ (hm.last_element)+1 ] / structureLength );
-  createNode('Z');
-  if ( globalArgs.newickFile )
-    fprintf( globalArgs.newickFile, "+z:%.3f", (float) Sequence[ (hm.last_element)+1 ] / structureLength );
-    if ( globalArgs.specular )
-      fprintf( globalArgs.newickFile, "," );
-  if ( globalArgs.specular )
+  int solutions;
+  long nodes;
+  double firstSolution;
+  struct depthCount_t *depth = hm.depth;
+  long *orbits;
+  struct energy_t *energy = &hm.energy;
+  long *cuts;
+  long lookups, hits;
+  if ( globalArgs.exactCover )
   {
-    createNode('z');
-    if ( globalArgs.newickFile )
-      fprintf( globalArgs.newickFile, "-z:%.3f", (float) Sequence[ (hm.last_element)+1 ] / structureLength );
+    if ( ! fillsBox() )
+    {
+      fprintf(stderr, "The exact cover engine needs a sequence that fills a cubic bounding box\n");
+      exit(EXIT_FAILURE);
+    }
+    startProgress( 1 );
+    registerWalk( 0, &hm );
+    solveExactCover();
+    stopProgress();
+    solutions = hm.solutions;
+    firstSolution = hm.firstSolution;
+    orbits = hm.orbits;
+    nodes = hm.nodes;
+    cuts = hm.cuts;
+    lookups = hm.lookups;
+    hits = hm.hits;
+  }
+  else if ( globalArgs.threads > 1 || globalArgs.checkpointFileName || globalArgs.resumeFileName )
+  {
+    startProgress( globalArgs.threads );
+    solutions = parallelSearch();
+    stopProgress();
+    firstSolution = search.firstSolution;
+    orbits = search.orbits;
+    energy = &search.energy;
+    nodes = search.nodes;
+    depth = search.depth;
+    cuts = search.cuts;
+    lookups = search.lookups;
+    hits = search.hits;
+  }
+  else
+  {
+    startProgress( 1 );
+    registerWalk( 0, &hm );
+    searchFromRoot();
+    stopProgress();
+    solutions = hm.solutions;
+    firstSolution = hm.firstSolution;
+    orbits = hm.orbits;
+    nodes = hm.nodes;
+    depth = hm.depth;
+    cuts = hm.cuts;
+    lookups = hm.lookups;
+    hits = hm.hits;
   }
-  if ( globalArgs.newickFile )
-    fprintf( globalArgs.newickFile, ");" );
   
   clock_t end = clock();
-  fprintf (stderr, "Solutions found = %d\n", hm.solutions);
+  fprintf (stderr, "Solutions found = %d\n", solutions);
+  long folds = 0;
+  for ( i = 1; i <= 48; i++ )
+    folds += i * orbits[i];
+  fprintf (stderr, "Solutions with their %s = %ld\n",
+           globalArgs.specular ? "rotations" : "rotations and reflections", folds);
+  for ( i = 1; i <= 48; i++ )
+    if ( orbits[i] )
+      fprintf (stderr, "  orbit of %2d: %ld\n", i, orbits[i]);
+  fprintf (stderr, "Nodes = %ld\n", nodes);
+  if ( ! globalArgs.exactCover )
+  {
+    long outOfBox = 0, overlaps = 0;
+    for ( i = 0; i < nbElements; i++ )
+    {
+      outOfBox += depth[i].outOfBox;
+      overlaps += depth[i].overlaps;
+    }
+    fprintf (stderr, "Directions out of the box = %ld, onto the walk = %ld\n", outOfBox, overlaps);
+    if ( globalArgs.verbose )
+    {
+      fprintf (stderr, "Element    nodes out of box     onto walk\n");
+      for ( i = 2; i < nbElements; i++ )
+        fprintf (stderr, "%7d %8ld %11ld %13ld\n", i + 1, depth[i].nodes, depth[i].outOfBox, depth[i].overlaps);
+    }
+  }
+  for ( i = 0; i < NB_PRUNE_RULES; i++ )
+    if ( globalArgs.pruning & ( 1 << i ) )
+      fprintf (stderr, "  cut by %s: %ld\n", pruneName[i], cuts[i]);
+  if ( globalArgs.pruning && ! hm.prune )
+    fprintf (stderr, "The checks of -p need a bounding box of 6 or less per side that the walk fills\n");
+  if ( hm.memo )
+    fprintf (stderr, "Subtrees counted from the table = %ld of %ld\n", hits, lookups);
+  else if ( globalArgs.memoryMB )
+    fprintf (stderr, "The table of -m needs a cubic bounding box of 4 or less that the walk fills, "
+                     "and a sequence that does not read the same from both ends\n");
+
+  if ( globalArgs.best )
+    printBest();
 
   fprintf(stderr, "Time elapsed = %d (%.3f secs)\n", (int) (end - start), (float) (end - start) / CLOCKS_PER_SEC);
+  if ( end > start )
+    fprintf(stderr, "Nodes per second = %.0f\n",
+            (double) ( nodes - checkpoint.nodes ) * CLOCKS_PER_SEC / ( end - start ));
+  if ( globalArgs.reportFileName )
+    writeReport( globalArgs.resumeFileName ? globalArgs.resumeFileName
+                 : globalArgs.sequenceFileName ? globalArgs.sequenceFileName
+                 : globalArgs.sequenceArg ? globalArgs.sequenceArg : "snake",
+                 1, solutions, nodes, firstSolution, ! solutions, start );
 
+  if ( globalArgs.outFile != stdout && fclose( globalArgs.outFile ) )
+  {
+    fprintf(stderr, "Could not write %s\n", globalArgs.outFileName);
+    exit(EXIT_FAILURE);
+  }
   if ( globalArgs.energyFile )
-    fclose ( globalArgs.energyFile );
+  {
+    writeEnergy( globalArgs.energyFile, energy );
+    if ( fclose( globalArgs.energyFile ) )
+    {
+      fprintf(stderr, "Could not write %s\n", globalArgs.energyFileName);
+      exit(EXIT_FAILURE);
+    }
+  }
   if ( globalArgs.newickFile )
+  {
+    flushNewick();
     fclose ( globalArgs.newickFile );
+  }
 
   destroy_hm();
   exit(EXIT_SUCCESS);
 }
 
 /* Functions */
-void init_hm ( int * seq, int volume )
+/* Records the time of the first solution of the walk in hm. Called once, so
+ * it costs nothing to the rest of the search. */
+static void firstSolutionFound()
 {
-  int i = 0;
-  hm.solutions = 0;
-  hm.MAX_length = volume;
-  hm.coord = malloc(sizeof(struct coordinates_t)*volume);
-  for( i = 0; i < volume; i++ )
-    hm.coord[i].x = hm.coord[i].y = hm.coord[i].z = 0;
-  for( i = 1; i < seq[0]; i++ )
-    hm.coord[i].x = i;
-  for( i = seq[0]; i < seq[0] + seq[1] - 1; i++ )
-  {
-    hm.coord[i].x = hm.coord[i-1].x;
-    hm.coord[i].y = i - seq[0] + 1;
-  }
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  hm.firstSolution = ( now.tv_sec - hm.started.tv_sec ) + ( now.tv_nsec - hm.started.tv_nsec ) / 1e9;
+}
+
+/* Bit of a cell in the occupancy grid of the given side */
+static inline int cellBit(int x, int y, int z, const int side)
+{
+  if ( ! ( side & ( side - 1 ) ) )
+    return ( x & ( side - 1 ) ) + side * ( ( y & ( side - 1 ) ) + side * ( z & ( side - 1 ) ) );
+  int *w = hm.wrap + hm.MAX_length;
+  return w[x] + side * ( w[y] + side * w[z] );
+}
+
+/* Contacts a cell about to be walked makes with the walk so far: its
+ * neighbours in the grid, but the one before it in the chain. Cells outside
+ * the bounding box are empty, and would be another cell's bit in the grid. */
+static inline int newContacts(struct coordinates_t c, const int side)
+{
+  static const int d[6][3] = { {1,0,0}, {-1,0,0}, {0,1,0}, {0,-1,0}, {0,0,1}, {0,0,-1} };
+  int k;
+  int contacts = -1;
+  for ( k = 0; k < 6; k++ )
+  {
+    int x = c.x + d[k][0], y = c.y + d[k][1], z = c.z + d[k][2];
+    if ( x < hm.min.x || x > hm.max.x || y < hm.min.y || y > hm.max.y || z < hm.min.z || z > hm.max.z )
+      continue;
+    int b = cellBit( x, y, z, side );
+    contacts += ( hm.occupied[ b >> 6 ] >> ( b & 63 ) ) & 1;
+  }
+  return contacts;
+}
+
+/* Makes room for a number of contacts in the histogram h */
+static void energyGrow(struct energy_t *h, int contacts)
+{
+  int r, stride = h->stride ? h->stride : 16;
+  while ( stride <= contacts )
+    stride *= 2;
+  long *counts = calloc( (size_t) ( nbElements + 2 ) * stride, sizeof(long) );
+  if ( ! counts )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for ( r = 0; h->counts && r < nbElements + 2; r++ )
+    memcpy( counts + (size_t) r * stride, h->counts + (size_t) r * h->stride, sizeof(long) * h->stride );
+  free( h->counts );
+  h->counts = counts;
+  h->stride = stride;
+}
+
+static inline void energyAdd(struct energy_t *h, int row, int contacts, long n)
+{
+  if ( contacts >= h->stride )
+    energyGrow( h, contacts );
+  h->counts[ (size_t) row * h->stride + contacts ] += n;
+}
+
+/* Adds the histogram src to dst */
+static void energyMerge(struct energy_t *dst, const struct energy_t *src)
+{
+  int r, c;
+  for ( r = 0; src->counts && r < nbElements + 2; r++ )
+    for ( c = 0; c < src->stride; c++ )
+      if ( src->counts[ (size_t) r * src->stride + c ] )
+        energyAdd( dst, r, c, src->counts[ (size_t) r * src->stride + c ] );
+}
+
+/* Writes the histogram h as CSV: a row per element from the third, with
+ * the length of the walk there and its nodes by contacts, then the
+ * solutions and the folds by contacts */
+void writeEnergy(FILE *f, const struct energy_t *h)
+{
+  int r, c, length = Sequence[0] + Sequence[1] - 2;
+  int columns = 0;
+  for ( r = 0; h->counts && r < nbElements + 2; r++ )
+    for ( c = columns; c < h->stride; c++ )
+      if ( h->counts[ (size_t) r * h->stride + c ] )
+        columns = c + 1;
+  fprintf( f, "length/contacts" );
+  for ( c = 0; c < columns; c++ )
+    fprintf( f, ",%d", c );
+  fprintf( f, "\n" );
+  for ( r = 2; r < nbElements + 2; r++ )
+  {
+    if ( r < nbElements )
+    {
+      length += Sequence[r] - 1;
+      fprintf( f, "%d", length );
+    }
+    else
+      fprintf( f, r == nbElements ? "solutions" : "folds" );
+    for ( c = 0; c < columns; c++ )
+      fprintf( f, ",%ld", h->counts[ (size_t) r * h->stride + c ] );
+    fprintf( f, "\n" );
+  }
+}
+
+void init_hm ( int * seq, int nbElements, const int box[3] )
+{
+  int i = 0;
+  int volume = 1;
+  for( i = 0; i < nbElements; i++ )
+    volume += seq[i] - 1;
+  hm.seq = seq;
+  hm.nbElements = nbElements;
+  memcpy( hm.dims, box, sizeof(hm.dims) );
+  hm.box = box[2];
+  hm.cubic = box[0] == box[2];
+  hm.reversible = 1;
+  for( i = 0; i < nbElements / 2; i++ )
+    if ( seq[i] != seq[ nbElements - 1 - i ] )
+      hm.reversible = 0;
+  hm.solutions = 0;
+  hm.nodes = 0;
+  hm.firstSolution = -1;
+  clock_gettime( CLOCK_MONOTONIC, &hm.started );
+  hm.MAX_length = volume;
+  hm.coord = malloc(sizeof(struct coordinates_t)*volume);
+  for( i = 0; i < volume; i++ )
+    hm.coord[i].x = hm.coord[i].y = hm.coord[i].z = 0;
+  for( i = 1; i < seq[0]; i++ )
+    hm.coord[i].x = i;
+  for( i = seq[0]; i < seq[0] + seq[1] - 1; i++ )
+  {
+    hm.coord[i].x = hm.coord[i-1].x;
+    hm.coord[i].y = i - seq[0] + 1;
+  }
+
+  hm.length = seq[0] + seq[1] - 2;
+  hm.last_element = 1;
+  hm.last_direction = 'Y';
+
+  hm.max.x = seq[0] - 1;
+  hm.max.y = seq[1] - 1;
+  hm.max.z = 0;
+
+  hm.min.x = hm.min.y = hm.min.z = 0;
+
+  hm.dirs = malloc( nbElements );
+  hm.stack = malloc( sizeof(struct frame_t) * nbElements );
+  hm.depth = calloc( nbElements, sizeof(struct depthCount_t) );
+  if ( ! hm.coord || ! hm.dirs || ! hm.stack || ! hm.depth )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  hm.dirs[0] = 'X';
+  hm.dirs[1] = 'Y';
+  hm.stack[0].dir = 'Y';
+  memset( hm.orbits, 0, sizeof(hm.orbits) );
+  hm.contacts = 0;
+  hm.energy.counts = NULL;
+  hm.energy.stride = 0;
+  hm.frontier = 0;
+  hm.path = NULL;
+  hm.pathEnd = 0;
+  hm.pathCounted = 0;
+  hm.task = NULL;
+  initGrid();
+
+  for( i = 0; i <= hm.length; i++ )
+  {
+    int b = cellBit( hm.coord[i].x, hm.coord[i].y, hm.coord[i].z, hm.side );
+    hm.occupied[ b >> 6 ] |= 1ULL << ( b & 63 );
+  }
+
+  int fills = hm.box && volume == hm.dims[0] * hm.dims[1] * hm.dims[2];
+  hm.memo = globalArgs.memoryMB && fills && hm.cubic && hm.box > 1 && hm.box <= 4
+            && ! hm.reversible && nbElements < 128;
+  hm.table = NULL;
+  hm.lookups = hm.hits = 0;
+}
+
+/* Allocates the grid of the walk in hm, for its box and its length */
+static void initGrid()
+{
+  int i;
+  int volume = hm.MAX_length;
+
+  /* The walk always fits in a window of side cells per dimension (the
+   * bounding box, or its length when there is none), so the coordinates
+   * modulo side tell the cells apart and the grid needs no more bits. The
+   * bits of the cells are ints (cellBit), so the grid is at most INT_MAX. */
+  hm.side = hm.box ? hm.box : volume;
+  long long cells = (long long) hm.side * hm.side * hm.side;
+  if ( cells > INT_MAX )
+  {
+    fprintf(stderr, "The occupancy grid for %d cells per side is too big. Use -b\n", hm.side);
+    exit(EXIT_FAILURE);
+  }
+  hm.occupied = calloc( ( cells + 63 ) / 64 + GRID_WORDS_MAX, sizeof(uint64_t) );
+  hm.wrap = malloc( sizeof(int) * ( 2 * volume + 1 ) );
+  if ( ! hm.occupied || ! hm.wrap )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for( i = -volume; i <= volume; i++ )
+    hm.wrap[ i + volume ] = ( ( i % hm.side ) + hm.side ) % hm.side;
+
+  /* The checks look at the whole grid at once, in a few words */
+  memset( hm.cuts, 0, sizeof(hm.cuts) );
+  int fills = hm.box && volume == hm.dims[0] * hm.dims[1] * hm.dims[2];
+  hm.prune = fills && hm.box <= GRID_SIDE_MAX ? globalArgs.pruning : 0;
+  memset( hm.layer, 0, sizeof(hm.layer) );
+  memset( &hm.cells, 0, sizeof(hm.cells) );
+  if ( hm.prune )
+  {
+    int x, y, z;
+    for ( x = 0; x < hm.side; x++ )
+      for ( y = 0; y < hm.side; y++ )
+        for ( z = 0; z < hm.side; z++ )
+        {
+          int b = cellBit( x, y, z, hm.side );
+          uint64_t bit = 1ULL << ( b & 63 );
+          hm.layer[0][x].w[ b >> 6 ] |= bit;
+          hm.layer[1][y].w[ b >> 6 ] |= bit;
+          hm.layer[2][z].w[ b >> 6 ] |= bit;
+          hm.cells.w[ b >> 6 ] |= bit;
+        }
+  }
+}
+
+/*
+ * Pruning.
+ * Once the walk spans the bounding box in the three dimensions the box is
+ * fixed in the grid (all of it for a cube), and when the walk has to fill
+ * it the empty cells of the box are the ones left to walk. The checks of -p
+ * then cut the nodes that cannot be finished:
+ *  p  the walk starts on a cell of colour 0 of the checkerboard and
+ *     alternates, so a box of odd volume must have its corners of colour 0;
+ *  d  every empty cell but the last one walked has two neighbours on the
+ *     walk, so it needs two neighbours that are empty or the end of the
+ *     walk, and only one cell can have a single one;
+ *  r  every empty cell has to be reachable from the end of the walk.
+ * The grid fits in one word for boxes up to 4, and in two or four for 5
+ * and 6, and the neighbours of a set of cells are found with shifts. These
+ * are necessary conditions for any walk, so they hold for walks of rigid
+ * elements too.
+ */
+
+/* Operations on the words of a grid of the given side */
+static inline __attribute__((always_inline)) grid_t gridLoad(const uint64_t *words, const int side)
+{
+  grid_t g = { { 0 } };
+  int i;
+  for ( i = 0; i < GRID_WORDS(side); i++ )
+    g.w[i] = words[i];
+  return g;
+}
+
+static inline __attribute__((always_inline)) grid_t gridZero()
+{
+  grid_t g = { { 0 } };
+  return g;
+}
+
+static inline __attribute__((always_inline)) grid_t gridAnd(grid_t a, grid_t b, const int side)
+{
+  int i;
+  for ( i = 0; i < GRID_WORDS(side); i++ )
+    a.w[i] &= b.w[i];
+  return a;
+}
+
+static inline __attribute__((always_inline)) grid_t gridOr(grid_t a, grid_t b, const int side)
+{
+  int i;
+  for ( i = 0; i < GRID_WORDS(side); i++ )
+    a.w[i] |= b.w[i];
+  return a;
+}
+
+/* a without the cells of b */
+static inline __attribute__((always_inline)) grid_t gridAndNot(grid_t a, grid_t b, const int side)
+{
+  int i;
+  for ( i = 0; i < GRID_WORDS(side); i++ )
+    a.w[i] &= ~b.w[i];
+  return a;
+}
+
+static inline __attribute__((always_inline)) int gridEmpty(grid_t a, const int side)
+{
+  uint64_t any = 0;
+  int i;
+  for ( i = 0; i < GRID_WORDS(side); i++ )
+    any |= a.w[i];
+  return ! any;
+}
+
+static inline __attribute__((always_inline)) int gridEqual(grid_t a, grid_t b, const int side)
+{
+  uint64_t diff = 0;
+  int i;
+  for ( i = 0; i < GRID_WORDS(side); i++ )
+    diff |= a.w[i] ^ b.w[i];
+  return ! diff;
+}
+
+/* Moves every cell n bits up, or down with a negative n */
+static inline __attribute__((always_inline)) grid_t gridShift(grid_t a, int n, const int side)
+{
+  grid_t g = { { 0 } };
+  int i, words = GRID_WORDS(side);
+  if ( words == 1 )
+  {
+    g.w[0] = n >= 0 ? a.w[0] << n : a.w[0] >> -n;
+    return g;
+  }
+  int q = ( n >= 0 ? n : -n ) >> 6, r = ( n >= 0 ? n : -n ) & 63;
+  for ( i = 0; i < words; i++ )
+  {
+    int from = n >= 0 ? i - q : i + q;
+    uint64_t v = from >= 0 && from < words ? ( n >= 0 ? a.w[from] << r : a.w[from] >> r ) : 0;
+    int carry = n >= 0 ? from - 1 : from + 1;
+    if ( r && carry >= 0 && carry < words )
+      v |= n >= 0 ? a.w[carry] >> ( 64 - r ) : a.w[carry] << ( 64 - r );
+    g.w[i] = v;
+  }
+  return g;
+}
+
+static inline __attribute__((always_inline)) grid_t gridCell(int b)
+{
+  grid_t g = { { 0 } };
+  g.w[ b >> 6 ] = 1ULL << ( b & 63 );
+  return g;
+}
+
+/* Cells of the box whose neighbour along axis, on the + side (or - side
+ * with minus), is in b. The grid wraps around, the box does not. */
+static inline __attribute__((always_inline)) grid_t boxNeighbours(grid_t b, int axis, int minus, int stride, const int side)
+{
+  grid_t first = hm.layer[axis][0], last = hm.layer[axis][side-1];
+  int *w = hm.wrap + hm.MAX_length;
+  if ( minus )
+  {
+    int lo = axis == 0 ? hm.min.x : axis == 1 ? hm.min.y : hm.min.z;
+    return gridAndNot( gridOr( gridAndNot( gridShift( b, stride, side ), first, side ),
+                               gridAnd( gridShift( b, - ( side - 1 ) * stride, side ), first, side ), side ),
+                       hm.layer[axis][ w[lo] ], side );
+  }
+  int hi = axis == 0 ? hm.max.x : axis == 1 ? hm.max.y : hm.max.z;
+  return gridAndNot( gridOr( gridAndNot( gridShift( b, - stride, side ), last, side ),
+                             gridAnd( gridShift( b, ( side - 1 ) * stride, side ), last, side ), side ),
+                     hm.layer[axis][ w[hi] ], side );
+}
+
+/* Cells next to a cell of b */
+static inline __attribute__((always_inline)) grid_t boxAdjacent(grid_t b, const int side)
+{
+  int a;
+  grid_t n = gridZero();
+  for ( a = 0; a < 3; a++ )
+  {
+    int stride = a == 0 ? 1 : a == 1 ? side : side * side;
+    n = gridOr( n, gridOr( boxNeighbours( b, a, 0, stride, side ),
+                           boxNeighbours( b, a, 1, stride, side ), side ), side );
+  }
+  return n;
+}
+
+/* Cells of the bounding box of the walk. With a cuboid the grid is a cube
+ * of its longest side, and the box only the layers the walk spans. */
+static inline __attribute__((always_inline)) grid_t boxCells(const int side)
+{
+  if ( hm.cubic )
+    return hm.cells;
+  int *w = hm.wrap + hm.MAX_length;
+  int lo[3] = { hm.min.x, hm.min.y, hm.min.z }, hi[3] = { hm.max.x, hm.max.y, hm.max.z };
+  grid_t box = hm.cells;
+  int a, c;
+  for ( a = 0; a < 3; a++ )
+  {
+    grid_t span = hm.layer[a][ w[ lo[a] ] ];
+    for ( c = lo[a] + 1; c <= hi[a]; c++ )
+      span = gridOr( span, hm.layer[a][ w[c] ], side );
+    box = gridAnd( box, span, side );
+  }
+  return box;
+}
+
+/* The first check that cuts the walk in hm, -1 if it may still be finished */
+static inline __attribute__((always_inline)) int pruneRule(const int side)
+{
+  int sx = hm.max.x - hm.min.x, sy = hm.max.y - hm.min.y, sz = hm.max.z - hm.min.z;
+  if ( hm.cubic )
+  {
+    if ( sx < side - 1 || sy < side - 1 || sz < side - 1 )
+      return -1;
+  }
+  else
+  {
+    int t;
+    if ( sx > sy ) t = sx, sx = sy, sy = t;
+    if ( sy > sz ) t = sy, sy = sz, sz = t;
+    if ( sx > sy ) t = sx, sx = sy, sy = t;
+    if ( sx < hm.dims[0] - 1 || sy < hm.dims[1] - 1 || sz < hm.dims[2] - 1 )
+      return -1;
+  }
+  /* A box of odd volume has one cell more of the colour of its corners */
+  if ( ( hm.prune & PRUNE_PARITY ) && ( hm.MAX_length & 1 ) && ( ( hm.min.x + hm.min.y + hm.min.z ) & 1 ) )
+    return 0;
+
+  grid_t empty = gridAndNot( boxCells( side ), gridLoad( hm.occupied, side ), side );
+  struct coordinates_t c = hm.coord[ hm.length ];
+  grid_t end = gridCell( cellBit( c.x, c.y, c.z, side ) );
+  if ( hm.prune & PRUNE_DEAD )
+  {
+    /* Count the free neighbours of the empty cells up to two */
+    grid_t free = gridOr( empty, end, side );
+    grid_t one = gridZero(), two = one;
+    int a, minus;
+    for ( a = 0; a < 3; a++ )
+    {
+      int stride = a == 0 ? 1 : a == 1 ? side : side * side;
+      for ( minus = 0; minus < 2; minus++ )
+      {
+        grid_t n = boxNeighbours( free, a, minus, stride, side );
+        two = gridOr( two, gridAnd( one, n, side ), side );
+        one = gridOr( one, n, side );
+      }
+    }
+    grid_t single = gridAndNot( gridAnd( empty, one, side ), two, side );
+    if ( ! gridEmpty( gridAndNot( empty, one, side ), side ) )
+      return 1;
+    /* More than one cell with a single free neighbour */
+    int i, singles = 0;
+    for ( i = 0; i < GRID_WORDS(side); i++ )
+      singles += single.w[i] ? 1 + ( ( single.w[i] & ( single.w[i] - 1 ) ) != 0 ) : 0;
+    if ( singles > 1 )
+      return 1;
+  }
+  if ( hm.prune & PRUNE_REACH )
+  {
+    grid_t reached = gridAnd( boxAdjacent( end, side ), empty, side ), last;
+    do
+    {
+      last = reached;
+      reached = gridOr( reached, gridAnd( boxAdjacent( reached, side ), empty, side ), side );
+    }
+    while ( ! gridEqual( reached, last, side ) );
+    if ( ! gridEqual( reached, empty, side ) )
+      return 2;
+  }
+  return -1;
+}
+
+/*
+ * Memoized counting.
+ * With -c -m the number of solutions below a node is kept in a table, and a
+ * node whose state is found there is not searched again. The state is all
+ * that the rest of the search depends on: the cells taken, the element to
+ * walk next and the direction of the one before, and where the end of the
+ * walk is in the grid and in its bounding box. The walk fills the box, so
+ * every solution walks in three dimensions and has a full orbit, and the
+ * sequence must not read the same from both ends, since the copies found
+ * from the other end are only told apart by their whole walk.
+ * Every thread has a table of its own, of its share of -m megabytes.
+ */
+
+/* The state of the walk in hm, besides the cells taken */
+static inline uint64_t memoState(const int side)
+{
+  struct coordinates_t e = hm.coord[ hm.length ];
+  uint64_t state = cellBit( e.x, e.y, e.z, side );
+  state = state << 2 | ( e.x - hm.min.x );
+  state = state << 2 | ( e.y - hm.min.y );
+  state = state << 2 | ( e.z - hm.min.z );
+  state = state << 2 | ( hm.max.x - hm.min.x );
+  state = state << 2 | ( hm.max.y - hm.min.y );
+  state = state << 2 | ( hm.max.z - hm.min.z );
+  state = state << 3 | ( strchr( dirChar, hm.last_direction ) - dirChar );
+  return state << 7 | hm.last_element;
+}
+
+static inline struct memoEntry_t *memoBucket(uint64_t occupied, uint64_t state)
+{
+  uint64_t h = occupied * 0x9E3779B97F4A7C15ULL ^ state * 0xC2B2AE3D27D4EB4FULL;
+  h ^= h >> 29;
+  return &hm.table[ 2 * ( h & ( hm.buckets - 1 ) ) ];
+}
+
+static void memoAllocate()
+{
+  uint64_t bytes = (uint64_t) globalArgs.memoryMB * 1024 * 1024 / globalArgs.threads;
+  hm.buckets = 1;
+  while ( 2 * hm.buckets * 2 * sizeof(struct memoEntry_t) <= bytes )
+    hm.buckets *= 2;
+  hm.table = calloc( 2 * hm.buckets, sizeof(struct memoEntry_t) );
+  if ( ! hm.table )
+  {
+    fprintf(stderr, "ERROR: out of memory for the table of -m\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Looks up the state of the node just walked. Returns 1 and counts its
+ * solutions if it is in the table, otherwise marks its frame to be stored. */
+static inline int memoLookup(struct frame_t *f, const int side)
+{
+  if ( ! hm.table )
+    memoAllocate();
+  uint64_t state = memoState( side );
+  struct memoEntry_t *b = memoBucket( hm.occupied[0], state );
+  int i;
+  hm.lookups++;
+  for ( i = 0; i < 2; i++ )
+    if ( b[i].state == state && b[i].occupied == hm.occupied[0] )
+    {
+      hm.hits++;
+      hm.solutions += b[i].solutions;
+      hm.orbits[ nbSymmetries ] += b[i].solutions;
+      return 1;
+    }
+  f->state = state;
+  f->solutions = hm.solutions;
+  return 0;
+}
+
+/* Stores the count of the subtree of the last element, searched whole */
+static inline void memoStore(struct frame_t *f)
+{
+  struct memoEntry_t *b = memoBucket( hm.occupied[0], f->state );
+  struct memoEntry_t e = { hm.occupied[0], f->state, hm.solutions - f->solutions };
+  /* The element is in the low bits: the smaller the state, the bigger
+   * the subtree */
+  int older = ! b[0].state || ( f->state & 127 ) <= ( b[0].state & 127 );
+  switch ( globalArgs.replacement )
+  {
+  case REPLACE_ALWAYS:
+    b[0] = e;
+    break;
+  case REPLACE_DEPTH:
+    if ( older )
+      b[0] = e;
+    break;
+  default:
+    b[ older ? 0 : 1 ] = e;
+  }
+}
+
+void destroy_hm()
+{
+  free( hm.coord );
+  free( hm.dirs );
+  free( hm.stack );
+  free( hm.depth );
+  free( hm.occupied );
+  free( hm.wrap );
+  free( hm.table );
+  free( hm.energy.counts );
+}
+
+/*
+ * Search engine.
+ * The search is a loop over an explicit stack with a frame per element
+ * walked. A frame keeps the bounding box from before its element, which with
+ * the coordinates of the element is all that is needed to take it back, and
+ * the directions left to try after it. The whole state of the search is
+ * then hm, so it can be paused, copied or handed to another thread.
+ */
+
+/* The children of a node go along the other two axes, -z only once the
+ * walk has left its plane (the mirror images are the same otherwise) */
+static inline void setChildren(struct frame_t *f)
+{
+  switch (f->dir)
+  {
+  case 'X':
+  case 'x':
+    memcpy( f->children, "YyZz", 4 );
+    f->nbChildren = walked_in_z() || globalArgs.specular ? 4 : 3;
+    break;
+  case 'Y':
+  case 'y':
+    memcpy( f->children, "XxZz", 4 );
+    f->nbChildren = walked_in_z() || globalArgs.specular ? 4 : 3;
+    break;
+  default:
+    memcpy( f->children, "XxYy", 4 );
+    f->nbChildren = 4;
+  }
+  f->next = 0;
+}
+
+static inline void newickWrite(const char *text, size_t size)
+{
+  if ( newick.used + size > sizeof(newick.buffer) )
+    flushNewick();
+  memcpy( newick.buffer + newick.used, text, size );
+  newick.used += size;
+}
+
+static inline void newickPut(char c)
+{
+  if ( newick.used == sizeof(newick.buffer) )
+    flushNewick();
+  newick.buffer[ newick.used++ ] = c;
+}
+
+/* Back from the last child tried: labels its branch in the Newick tree */
+static inline void childDone(struct frame_t *f)
+{
+  int dir = f->children[ f->next - 1 ];
+  int e = hm.last_element + 1;
+  if ( globalArgs.newickFile && e <= newick.limit )
+  {
+    newickPut( dir < 'a' ? '+' : '-' );
+    newickPut( dir < 'a' ? dir - 'A' + 'a' : dir );
+    newickWrite( newick.lengths[e], newick.lengthSizes[e] );
+    if ( f->next < f->nbChildren )
+      newickPut( ',' );
+  }
+}
+
+/* Opens the subtree of the element just walked in the Newick tree */
+static inline void newickOpen()
+{
+  if ( hm.last_element < newick.limit )
+    newickPut( '(' );
+  else if ( hm.last_element == newick.limit )
+    newick.collapsedFrom = hm.solutions;
+}
+
+/* Closes the subtree of the last element, before it is taken back */
+static inline void newickClose()
+{
+  if ( hm.last_element < newick.limit )
+    newickPut( ')' );
+  else if ( hm.last_element == newick.limit )
+  {
+    char count[16];
+    newickWrite( count, sprintf( count, "C%d", hm.solutions - newick.collapsedFrom ) );
+  }
+}
+
+static inline __attribute__((always_inline)) int placeElement(int dir, const int side)
+{
+  /* Replaying the path of a task, or stopped by -M */
+  if ( hm.path && hm.last_element < hm.pathEnd && dir != hm.path[ hm.last_element + 1 ] )
+    return 0;
+  if ( searchStopped || ( globalArgs.maxSolutions && hm.solutions >= globalArgs.maxSolutions ) )
+    return 0;
+
+  int elementLength = hm.seq[ hm.last_element + 1] - 1;
+  struct depthCount_t *count = &hm.depth[ hm.last_element + 1 ];
+
+  /* Check that the Hamiltonian walk wouldn't be outside bounds */
+  if ( hm.box )
+  {
+    /* End of the element, and how far it is from the other side of the
+     * walk along its axis */
+    struct coordinates_t e = hm.coord[hm.length];
+    int span;
+    switch (dir)
+    {
+    case 'X': e.x += elementLength; span = e.x - hm.min.x; break;
+    case 'x': e.x -= elementLength; span = hm.max.x - e.x; break;
+    case 'Y': e.y += elementLength; span = e.y - hm.min.y; break;
+    case 'y': e.y -= elementLength; span = hm.max.y - e.y; break;
+    case 'Z': e.z += elementLength; span = e.z - hm.min.z; break;
+    case 'z': e.z -= elementLength; span = hm.max.z - e.z; break;
+    default:
+      fprintf(stderr, "Direction '%d' unknown\n", dir);
+      exit(EXIT_FAILURE);
+    }
+    int outOfBox = span > hm.box - 1;
+    if ( ! outOfBox && ! hm.cubic )
+    {
+      /* In a cuboid the spans of the walk, from the shortest, have to fit
+       * the sides */
+      int sx = ( e.x > hm.max.x ? e.x : hm.max.x ) - ( e.x < hm.min.x ? e.x : hm.min.x );
+      int sy = ( e.y > hm.max.y ? e.y : hm.max.y ) - ( e.y < hm.min.y ? e.y : hm.min.y );
+      int sz = ( e.z > hm.max.z ? e.z : hm.max.z ) - ( e.z < hm.min.z ? e.z : hm.min.z );
+      int t;
+      if ( sx > sy ) t = sx, sx = sy, sy = t;
+      if ( sy > sz ) t = sy, sy = sz, sz = t;
+      if ( sx > sy ) t = sx, sx = sy, sy = t;
+      outOfBox = sx > hm.dims[0] - 1 || sy > hm.dims[1] - 1;
+    }
+    if ( outOfBox )
+    {
+      count->outOfBox++;
+      return 0;
+    }
+  }
+
+  /* Check that the new node's coordinates wouldn't overlap */
+  int dx = 0, dy = 0, dz = 0;
+  int i = 0;
+  switch (dir)
+  {
+  case 'X': dx = 1; break;
+  case 'x': dx = -1; break;
+  case 'Y': dy = 1; break;
+  case 'y': dy = -1; break;
+  case 'Z': dz = 1; break;
+  case 'z': dz = -1; break;
+  default:
+    fprintf(stderr, "Direction '%c' not known\n", dir);
+    exit(EXIT_FAILURE);
+  }
+  struct coordinates_t last = hm.coord[hm.length];
+  for ( i = 1; i <= elementLength; i++ )
+  {
+    int b = cellBit( last.x + i*dx, last.y + i*dy, last.z + i*dz, side );
+    if ( hm.occupied[ b >> 6 ] & ( 1ULL << ( b & 63 ) ) )
+    {
+      count->overlaps++;
+      return 0;
+    }
+  }
+
+  /* Update the hm structure with the new coordinates */
+  struct frame_t *f = &hm.stack[ hm.last_element ];
+  f->dir = dir;
+  f->min = hm.min;
+  f->max = hm.max;
+  f->contacts = hm.contacts;
+
+  struct coordinates_t end = { last.x + elementLength*dx, last.y + elementLength*dy, last.z + elementLength*dz };
+  hm.max.x < end.x ? hm.max.x = end.x : 0;
+  hm.max.y < end.y ? hm.max.y = end.y : 0;
+  hm.max.z < end.z ? hm.max.z = end.z : 0;
+  hm.min.x > end.x ? hm.min.x = end.x : 0;
+  hm.min.y > end.y ? hm.min.y = end.y : 0;
+  hm.min.z > end.z ? hm.min.z = end.z : 0;
+
+  int from = hm.length + 1;
+  int to =   hm.length + elementLength;
+  hm.length += elementLength;
+  for ( i = from; i <= to; i++ )
+  {
+    hm.coord[i].x = hm.coord[i-1].x + dx;
+    hm.coord[i].y = hm.coord[i-1].y + dy;
+    hm.coord[i].z = hm.coord[i-1].z + dz;
+    if ( globalArgs.energyFile || globalArgs.best )
+      hm.contacts += newContacts( hm.coord[i], side );
+    int b = cellBit( hm.coord[i].x, hm.coord[i].y, hm.coord[i].z, side );
+    hm.occupied[ b >> 6 ] |= 1ULL << ( b & 63 );
+  }
+
+  hm.last_direction = dir;
+  hm.last_element++;
+  hm.dirs[hm.last_element] = dir;
+  /* The nodes replayed by a task were counted by the split, or before the
+   * checkpoint */
+  if ( ! hm.path || hm.last_element > hm.pathCounted )
+  {
+    hm.nodes++;
+    count->nodes++;
+    if ( globalArgs.energyFile )
+      energyAdd( &hm.energy, hm.last_element, hm.contacts, 1 );
+  }
+  return 1;
+}
+
+static inline __attribute__((always_inline)) int expandNode(const int side)
+{
+  /* Check if the end of the sequence has been reached */
+  if (hm.last_element == hm.nbElements - 1)
+  {
+    int orbit = solutionOrbit();
+    if ( ! orbit )
+    {
+      /* Found again from the other end of the sequence */
+      removeElement( side );
+      return 0;
+    }
+    hm.solutions++;
+    hm.orbits[orbit]++;
+    if ( globalArgs.energyFile )
+    {
+      energyAdd( &hm.energy, hm.nbElements, hm.contacts, 1 );
+      energyAdd( &hm.energy, hm.nbElements + 1, hm.contacts, orbit );
+    }
+    if ( hm.firstSolution < 0 )
+    {
+      firstSolutionFound();
+      if ( globalArgs.verbose )
+      {
+        fprintf(stderr, "------------ First solution ------------\n");
+        print_hm();
+        fprintf(stderr, "----------------------------------------\n");
+      }
+    }
+    if ( globalArgs.best )
+    {
+      keepFold();
+      removeElement( side );
+      return 0;
+    }
+    if ( hm.task && globalArgs.maxSolutions )
+    {
+      unsigned char *o = realloc( hm.task->orbit, hm.solutions );
+      if ( ! o )
+      {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+      hm.task->orbit = o;
+      o[ hm.solutions - 1 ] = orbit;
+    }
+
+    if ( globalArgs.output && hm.task )
+    {
+      /* Written once the tasks before it are */
+      struct task_t *t = hm.task;
+      writeSolution( t->buffer );
+      long *ends = realloc( t->ends, sizeof(long) * ( t->nbEnds + 1 ) );
+      if ( ! ends )
+      {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+      t->ends = ends;
+      t->ends[ t->nbEnds++ ] = ftell( t->buffer );
+    }
+    else if ( globalArgs.output )
+      writeSolution( globalArgs.outFile );
+    
+    removeElement( side );
+
+    if ( globalArgs.newickFile && hm.last_element < newick.limit )
+      newickPut( 'S' );
+    
+    return 0;
+  }
+
+  if ( hm.prune )
+  {
+    int rule = pruneRule( side );
+    if ( rule >= 0 )
+    {
+      hm.cuts[rule]++;
+      removeElement( side );
+      return 0;
+    }
+  }
+
+  if ( globalArgs.best && boundCut() )
+  {
+    best.cuts++;
+    removeElement( side );
+    return 0;
+  }
+
+  if ( hm.memo && ! hm.frontier )
+  {
+    struct frame_t *f = &hm.stack[ hm.last_element - 1 ];
+    f->state = 0;
+    /* Not the nodes on the path of a task, searched only in part, nor the
+     * last -T elements, whose subtrees are too small to pay for the lookup */
+    if ( hm.nbElements - hm.last_element >= globalArgs.memoLeft
+         && ( ! hm.path || hm.last_element > hm.pathCounted ) && memoLookup( f, side ) )
+    {
+      removeElement( side );
+      return 0;
+    }
+  }
+
+  if ( globalArgs.maxSolutions && globalArgs.maxSolutions == hm.solutions )
+  {
+    removeElement( side );
+    return 0;
+  }
+
+  /* Cut for the parallel search: the subtree becomes a task */
+  if ( hm.frontier && hm.last_element == hm.frontier )
+  {
+    addTask();
+    removeElement( side );
+    return 0;
+  }
+
+  return 1;
+}
+
+static inline __attribute__((always_inline)) void removeElement(const int side)
+{
+  struct frame_t *f = &hm.stack[ hm.last_element - 1 ];
+  int i;
+  for ( i = hm.length - hm.seq[ hm.last_element ] + 2; i <= hm.length; i++ )
+  {
+    int b = cellBit( hm.coord[i].x, hm.coord[i].y, hm.coord[i].z, side );
+    hm.occupied[ b >> 6 ] &= ~( 1ULL << ( b & 63 ) );
+  }
+  hm.length -= hm.seq[ hm.last_element ] - 1;
+  hm.last_element--;
+  hm.last_direction = hm.stack[ hm.last_element - 1 ].dir;
+  hm.min = f->min;
+  hm.max = f->max;
+  hm.contacts = f->contacts;
+}
+
+/* The search loop, for a grid of the given side. Inlined with a constant
+ * side, the bit of a cell is computed without the wrap table when the side
+ * is a power of two, and with shifts or small multiplications otherwise. */
+static inline __attribute__((always_inline)) void searchWalk(const int side)
+{
+  struct frame_t *f = &hm.stack[0];
+  setChildren( f );
+  if ( globalArgs.newickFile )
+    newickPut( '(' );
+  for (;;)
+  {
+    if ( checkpoint.requested )
+      checkpointStop();
+    f = &hm.stack[ hm.last_element - 1 ];
+    if ( f->next == f->nbChildren )
+    {
+      if ( hm.last_element == 1 )
+        break;
+      if ( globalArgs.newickFile )
+        newickClose();
+      if ( hm.memo && f->state )
+        memoStore( f );
+      removeElement( side );
+      childDone( &hm.stack[ hm.last_element - 1 ] );
+      continue;
+    }
+    if ( placeElement( f->children[ f->next++ ], side ) && expandNode( side ) )
+    {
+      setChildren( &hm.stack[ hm.last_element - 1 ] );
+      if ( globalArgs.newickFile )
+        newickOpen();
+      continue;
+    }
+    childDone( f );
+  }
+  if ( globalArgs.newickFile )
+    newickWrite( ");", 2 );
+}
+
+void searchFromRoot()
+{
+#ifndef CUBE_GENERIC
+  /* The grids of 3 to 6 cells per side get a copy of the search of their
+   * own (boxes up to 4x4x4, and the large puzzles) */
+  switch ( hm.side )
+  {
+    case 3: searchWalk( 3 ); return;
+    case 4: searchWalk( 4 ); return;
+    case 5: searchWalk( 5 ); return;
+    case 6: searchWalk( 6 ); return;
+  }
+#endif
+  searchWalk( hm.side );
+}
+
+/*
+ * Estimate of the search (-t).
+ * Knuth's estimator: a probe walks down from the root along random
+ * children, and at every node it tries all the children with the rules of
+ * the search (setChildren, placeElement, expandNode and the checks of -p).
+ * With W the product of the numbers of open children met on the way down,
+ * the children of a node count for W nodes each and its solutions for W
+ * solutions each, so the sums over a probe are unbiased estimates of the
+ * nodes and solutions of the search. Their means over the probes are given
+ * with 95% confidence intervals (1.96 standard errors), and the time of the
+ * search from the nodes per second of the probes, which walk the nodes as
+ * the search does. A tree whose nodes sit in a few rare branches needs many
+ * probes before its variance shows, so the intervals can be too narrow when
+ * the probes are few.
+ */
+
+static uint64_t probeState;
+static long probesDone;       /* For the progress report */
+
+/* xorshift64*, as in cubegen */
+static uint64_t nextRandom()
+{
+  probeState ^= probeState >> 12;
+  probeState ^= probeState << 25;
+  probeState ^= probeState >> 27;
+  return probeState * 0x2545F4914F6CDD1DULL;
+}
+
+/* One probe from the root, and back. Sets its estimates of the nodes, the
+ * solutions and the directions tried, and adds the directions it tried
+ * itself to tried. */
+static inline __attribute__((always_inline)) void estimateProbe(double *x, long *tried, const int side)
+{
+  double weight = 1;
+  int i;
+  x[0] = x[1] = x[2] = 0;
+  for (;;)
+  {
+    struct frame_t *f = &hm.stack[ hm.last_element - 1 ];
+    char open[4];
+    int nbOpen = 0, placed = 0;
+    setChildren( f );
+    x[2] += weight * f->nbChildren;
+    *tried += f->nbChildren;
+    for ( i = 0; i < f->nbChildren; i++ )
+    {
+      int found = hm.solutions;
+      if ( ! placeElement( f->children[i], side ) )
+        continue;
+      placed++;
+      if ( expandNode( side ) )
+      {
+        open[ nbOpen++ ] = f->children[i];
+        removeElement( side );
+      }
+      else
+        x[1] += weight * ( hm.solutions - found );
+    }
+    x[0] += weight * placed;
+    if ( ! nbOpen )
+      break;
+    weight *= nbOpen;
+    /* Tried again to walk down, it costs the probe as much */
+    ++*tried;
+    placeElement( open[ nextRandom() % nbOpen ], side );
+    expandNode( side );
+  }
+  while ( hm.last_element > 1 )
+    removeElement( side );
+}
+
+static void estimateFromRoot(double *x, long *tried)
+{
+#ifndef CUBE_GENERIC
+  switch ( hm.side )
+  {
+    case 3: estimateProbe( x, tried, 3 ); return;
+    case 4: estimateProbe( x, tried, 4 ); return;
+    case 5: estimateProbe( x, tried, 5 ); return;
+    case 6: estimateProbe( x, tried, 6 ); return;
+  }
+#endif
+  estimateProbe( x, tried, hm.side );
+}
+
+void estimateSearch()
+{
+  double mean[3] = { 0, 0, 0 }, squares[3] = { 0, 0, 0 }, error[3];
+  long p, tried = 0;
+  int k;
+  struct timespec from, to;
+  probeState = globalArgs.probeSeed * 0x9E3779B97F4A7C15ULL + 1;
+  startProgress( 1 );
+  registerWalk( 0, &hm );
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &from );
+  for ( p = 1; p <= globalArgs.probes; p++ )
+  {
+    double x[3];
+    probesDone = p - 1;
+    estimateFromRoot( x, &tried );
+    /* Running means and sums of squared deviations (Welford) */
+    for ( k = 0; k < 3; k++ )
+    {
+      double delta = x[k] - mean[k];
+      mean[k] += delta / p;
+      squares[k] += delta * ( x[k] - mean[k] );
+    }
+  }
+  clock_gettime( CLOCK_THREAD_CPUTIME_ID, &to );
+  registerWalk( 0, NULL );
+  stopProgress();
+
+  for ( k = 0; k < 3; k++ )
+    error[k] = globalArgs.probes > 1 ? 1.96 * sqrt( squares[k] / ( globalArgs.probes - 1 ) / globalArgs.probes ) : 0;
+  /* The search costs about the same per direction tried as the probes */
+  double secs = ( to.tv_sec - from.tv_sec ) + ( to.tv_nsec - from.tv_nsec ) / 1e9;
+  double perTry = secs / tried;
+  fprintf(stderr, "Probes = %ld (seed %llu), %ld directions tried in %.3f secs\n", globalArgs.probes,
+          (unsigned long long) globalArgs.probeSeed, tried, secs);
+  fprintf(stderr, "Nodes = %.4g +- %.2g (95%%)\n", mean[0], error[0]);
+  fprintf(stderr, "Solutions = %.4g +- %.2g (95%%)\n", mean[1], error[1]);
+  fprintf(stderr, "Directions tried = %.4g +- %.2g (95%%)\n", mean[2], error[2]);
+  if ( secs > 0 )
+  {
+    fprintf(stderr, "Nodes per second = %.0f\n", mean[0] / ( mean[2] * perTry ));
+    fprintf(stderr, "Projected time = %.4g +- %.2g secs", mean[2] * perTry, error[2] * perTry);
+    if ( globalArgs.threads > 1 )
+      fprintf(stderr, ", %.4g with %d threads", mean[2] * perTry / globalArgs.threads, globalArgs.threads);
+    fprintf(stderr, "\n");
+  }
+}
+
+/*
+ * Branch and bound (-B).
+ * With -B max the search keeps the -K folds with the most contacts (the
+ * most compact ones), and with -B min those with the fewest. The contacts
+ * of the walk are counted as the cells are walked, as for -E, and only go
+ * up, so once -K folds are kept a node is cut when:
+ *  min  it already has as many contacts as the worst fold kept;
+ *  max  even a contact for every free side of the cells left could not
+ *       beat the worst fold kept. A cell walked has its predecessor next
+ *       to it and its successor to come, so it makes at most 4 contacts,
+ *       and the last one 5. A fold has no more contacts than the edges of
+ *       the grid of its box less the V-1 of the chain, which a sequence
+ *       that fills its box always reaches (all its folds tie).
+ * The folds are kept with their directions and written at the end, the
+ * best first, in the order of the search for equal contacts.
+ */
+
+void initBest()
+{
+  best.contacts = malloc( sizeof(int) * globalArgs.bestCount );
+  best.dirs = malloc( (size_t) hm.nbElements * globalArgs.bestCount );
+  if ( ! best.contacts || ! best.dirs )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  best.maxContacts = INT_MAX;
+  if ( hm.box )
+  {
+    long a = hm.dims[0], b = hm.dims[1], c = hm.dims[2];
+    long edges = ( a - 1 ) * b * c + a * ( b - 1 ) * c + a * b * ( c - 1 );
+    if ( edges - ( hm.MAX_length - 1 ) < INT_MAX )
+      best.maxContacts = edges - ( hm.MAX_length - 1 );
+  }
+}
+
+/* Checks if a fold of c contacts is better than one of d */
+static inline int betterFold(int c, int d)
+{
+  return globalArgs.best == BEST_MAX ? c > d : c < d;
+}
+
+static void keepFold()
+{
+  int n = hm.nbElements;
+  int i = best.nbFolds;
+  /* After the folds as good */
+  while ( i > 0 && betterFold( hm.contacts, best.contacts[ i - 1 ] ) )
+    i--;
+  if ( i == globalArgs.bestCount )
+    return;
+  int last = best.nbFolds < globalArgs.bestCount ? best.nbFolds : globalArgs.bestCount - 1;
+  memmove( best.contacts + i + 1, best.contacts + i, sizeof(int) * ( last - i ) );
+  memmove( best.dirs + (size_t) n * ( i + 1 ), best.dirs + (size_t) n * i, (size_t) n * ( last - i ) );
+  best.contacts[i] = hm.contacts;
+  memcpy( best.dirs + (size_t) n * i, hm.dirs, n );
+  best.nbFolds = last + 1;
+}
+
+static inline int boundCut()
+{
+  if ( best.nbFolds < globalArgs.bestCount )
+    return 0;
+  int worst = best.contacts[ best.nbFolds - 1 ];
+  if ( globalArgs.best == BEST_MIN )
+    return hm.contacts >= worst;
+  long left = hm.MAX_length - 1 - hm.length;
+  long bound = hm.contacts + 4 * left + 1;
+  if ( bound > best.maxContacts )
+    bound = best.maxContacts;
+  return bound <= worst;
+}
+
+void printBest()
+{
+  int i;
+  fprintf(stderr, "Cut by the bound = %ld\n", best.cuts);
+  for ( i = 0; i < best.nbFolds; i++ )
+  {
+    fprintf(stderr, "Fold %d: %d contacts\n", i + 1, best.contacts[i]);
+    if ( globalArgs.output )
+    {
+      memcpy( hm.dirs, best.dirs + (size_t) hm.nbElements * i, hm.nbElements );
+      walkDirections();
+      writeSolution( globalArgs.outFile );
+    }
+  }
+  free( best.contacts );
+  free( best.dirs );
+}
+
+/*
+ * Solution stream.
+ * With -o the solutions go to a single file: a text header with the
+ * sequence, then a record per solution with the direction of every element
+ * after the first two, which are always +X and +Y. An element turns off the
+ * axis of the one before it, so its direction is one of four and takes two
+ * bits: the high bit tells which of the two other axes (0 for the lower
+ * one) and the low bit the sign (1 for minus). The directions are packed
+ * four to a byte, the first in the low bits. -D turns a stream back into
+ * the CSV of the solutions.
+ */
+
+#define STREAM_MAGIC "cube-solutions 1"
+
+/* Bytes of a record of a sequence of n elements */
+static inline int recordSize(int n)
+{
+  return ( n - 2 + 3 ) / 4;
+}
+
+void writeStreamHeader(FILE *f, int *seq, int n)
+{
+  int i;
+  fprintf( f, "%s\nsequence ", STREAM_MAGIC );
+  for ( i = 0; i < n; i++ )
+    fprintf( f, i ? ",%d" : "%d", seq[i] );
+  fprintf( f, "\n" );
+}
+
+void writeSolution(FILE *f)
+{
+  if ( ! globalArgs.outFileName )
+  {
+    printCSV( hm.seq, f );
+    return;
+  }
+  unsigned char record[ recordSize( hm.nbElements ) ];
+  int i;
+  memset( record, 0, sizeof(record) );
+  for ( i = 2; i < hm.nbElements; i++ )
+  {
+    int axis = ( strchr( dirChar, hm.dirs[i-1] ) - dirChar ) >> 1;
+    int d = strchr( dirChar, hm.dirs[i] ) - dirChar;
+    int turn = ( ( d >> 1 ) != ( axis ? 0 : 1 ) ) << 1 | ( d & 1 );
+    record[ ( i - 2 ) >> 2 ] |= turn << ( 2 * ( ( i - 2 ) & 3 ) );
+  }
+  fwrite( record, 1, sizeof(record), f );
+}
+
+void decodeStream(const char *fileName)
+{
+  FILE *f = fopen( fileName, "r" );
+  if ( ! f )
+  {
+    fprintf(stderr, "Could not open %s to read\n", fileName);
+    exit(EXIT_FAILURE);
+  }
+  char *line = NULL;
+  size_t size = 0;
+  int *seq = NULL;
+  int n = -1;
+  if ( getline( &line, &size, f ) != -1 && ! strcmp( line, STREAM_MAGIC "\n" )
+       && getline( &line, &size, f ) != -1 && ! strncmp( line, "sequence ", 9 )
+       && strchr( line, '\n' ) )
+    n = parseSequence( line + 9, &seq );
+  free( line );
+  if ( n < 0 )
+  {
+    fprintf(stderr, "%s is not a solution stream of cube\n", fileName);
+    exit(EXIT_FAILURE);
+  }
+
+  int i;
+  int volume = 1;
+  for ( i = 0; i < n; i++ )
+    volume += seq[i] - 1;
+  hm.seq = seq;
+  hm.nbElements = n;
+  hm.coord = malloc( sizeof(struct coordinates_t) * volume );
+  hm.dirs = malloc( n );
+  if ( ! hm.coord || ! hm.dirs )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t bytes = recordSize( n );
+  unsigned char record[ bytes ];
+  size_t got;
+  long solutions = 0;
+  while ( ( got = fread( record, 1, bytes, f ) ) == bytes )
+  {
+    int dir = 2;
+    hm.dirs[0] = 'X';
+    hm.dirs[1] = 'Y';
+    for ( i = 2; i < n; i++ )
+    {
+      int turn = ( record[ ( i - 2 ) >> 2 ] >> ( 2 * ( ( i - 2 ) & 3 ) ) ) & 3;
+      int axis = dir >> 1;
+      int other = turn & 2 ? ( axis == 2 ? 1 : 2 ) : ( axis ? 0 : 1 );
+      dir = 2 * other + ( turn & 1 );
+      hm.dirs[i] = dirChar[dir];
+    }
+    walkDirections();
+    printCSV( seq, stdout );
+    solutions++;
+  }
+  if ( got )
+  {
+    fprintf(stderr, "%s ends in the middle of a solution\n", fileName);
+    exit(EXIT_FAILURE);
+  }
+  fclose( f );
+  fprintf(stderr, "Solutions = %ld\n", solutions);
+  free( hm.coord );
+  free( hm.dirs );
+  free( seq );
+}
+
+/*
+ * Newick tree.
+ * Every node is named by the direction it was walked in, with the length
+ * of its element over the length of the walk as its branch length. A
+ * solution is a leaf named S. With -L the tree stops that many elements
+ * past the first two, and the nodes there are leaves named C and the
+ * number of solutions below them.
+ */
+
+void init_newick()
+{
+  int e;
+  newick.used = 0;
+  newick.limit = globalArgs.newickDepth ? globalArgs.newickDepth + 1 : hm.nbElements;
+  newick.lengths = malloc( sizeof(*newick.lengths) * hm.nbElements );
+  newick.lengthSizes = malloc( sizeof(int) * hm.nbElements );
+  if ( ! newick.lengths || ! newick.lengthSizes )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for ( e = 0; e < hm.nbElements; e++ )
+    newick.lengthSizes[e] = snprintf( newick.lengths[e], sizeof(newick.lengths[e]), ":%.3f",
+                                      (float) hm.seq[e] / hm.MAX_length );
+}
+
+void flushNewick()
+{
+  fwrite( newick.buffer, 1, newick.used, globalArgs.newickFile );
+  newick.used = 0;
+}
+
+/*
+ * Parallel search.
+ * The tree is walked down to the split depth by the main thread, and every
+ * node there becomes a task, numbered in the order of the sequential search.
+ * The tasks are dealt round robin to the queues of the threads; a thread
+ * whose queue is empty steals from the tail of the others. A thread searches
+ * a task from the root of its own walk, following the directions of the task
+ * down to the cut. The solutions of a task are written once all the tasks
+ * before it are, so they come out in the same order as with -j 1.
+ */
+
+/* New task at the end of the list, zeroed */
+static struct task_t *newTask()
+{
+  if ( search.nbTasks == search.maxTasks )
+  {
+    search.maxTasks = search.maxTasks ? 2 * search.maxTasks : 1024;
+    search.tasks = realloc( search.tasks, sizeof(struct task_t) * search.maxTasks );
+    if ( ! search.tasks )
+    {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  struct task_t *t = &search.tasks[ search.nbTasks++ ];
+  memset( t, 0, sizeof(struct task_t) );
+  return t;
+}
+
+void addTask()
+{
+  struct task_t *t = newTask();
+  t->path = malloc( hm.frontier + 1 );
+  if ( ! t->path )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy( t->path, hm.dirs, hm.frontier + 1 );
+  t->pathEnd = t->counted = hm.frontier;
+}
+
+/* Next task for thread id, -1 when there is none left anywhere */
+static int takeTask(int id)
+{
+  int i;
+  struct taskQueue_t *q = &search.queues[id];
+  pthread_mutex_lock( &q->lock );
+  int task = q->head < q->tail ? q->tasks[ q->head++ ] : -1;
+  pthread_mutex_unlock( &q->lock );
+  for ( i = 1; task < 0 && i < globalArgs.threads; i++ )
+  {
+    q = &search.queues[ ( id + i ) % globalArgs.threads ];
+    pthread_mutex_lock( &q->lock );
+    if ( q->head < q->tail )
+      task = q->tasks[ --q->tail ];
+    pthread_mutex_unlock( &q->lock );
+  }
+  return task;
+}
+
+/* Writes the solutions of task n, up to -M */
+static void writeTask(int n)
+{
+  struct task_t *t = &search.tasks[n];
+  int i;
+  if ( t->buffer )
+    fclose( t->buffer );
+  for ( i = 0; i < t->solutions && ! searchStopped; i++ )
+  {
+    search.written++;
+    if ( t->orbit )
+      search.orbits[ t->orbit[i] ]++;
+    if ( globalArgs.output )
+    {
+      long from = i ? t->ends[i-1] : 0;
+      fwrite( t->text + from, 1, t->ends[i] - from, globalArgs.outFile );
+    }
+    if ( globalArgs.maxSolutions && search.written == globalArgs.maxSolutions )
+      searchStopped = 1;
+  }
+  if ( ! t->orbit )
+    for ( i = 1; i <= 48; i++ )
+      search.orbits[i] += t->orbits[i];
+  energyMerge( &search.energy, &t->energy );
+  free( t->energy.counts );
+  free( t->text );
+  free( t->ends );
+  free( t->orbit );
+  free( t->path );
+}
+
+static void *searchThread(void *arg)
+{
+  int id = (int) (intptr_t) arg;
+  int n, i;
+  init_hm( Sequence, nbElements, globalArgs.boundingBox );
+  hm.started = search.started;
+  registerWalk( id, &hm );
+  for (;;)
+  {
+    /* Between two tasks the walk holds none for a checkpoint */
+    if ( checkpoint.requested )
+      checkpointStop();
+    if ( ( n = takeTask( id ) ) < 0 )
+      break;
+    struct task_t *t = &search.tasks[n];
+    if ( globalArgs.output && ! searchStopped )
+    {
+      t->buffer = open_memstream( &t->text, &t->size );
+      if ( ! t->buffer )
+      {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    hm.solutions = 0;
+    hm.nodes = 0;
+    memset( hm.depth, 0, sizeof(struct depthCount_t) * nbElements );
+    memset( hm.cuts, 0, sizeof(hm.cuts) );
+    memset( hm.orbits, 0, sizeof(hm.orbits) );
+    hm.task = t;
+    hm.path = t->path;
+    hm.pathEnd = t->pathEnd;
+    hm.pathCounted = t->counted;
+    searchFromRoot();
+    if ( t->buffer )
+      fflush( t->buffer );
+
+    pthread_mutex_lock( &search.streamLock );
+    t->solutions = hm.solutions;
+    pthread_mutex_lock( &progress.lock );
+    search.nodes += hm.nodes;
+    search.finished++;
+    t->nodes = hm.nodes;
+    hm.nodes = 0;
+    pthread_mutex_unlock( &progress.lock );
+    for ( i = 0; i < nbElements; i++ )
+    {
+      search.depth[i].nodes += hm.depth[i].nodes;
+      search.depth[i].outOfBox += hm.depth[i].outOfBox;
+      search.depth[i].overlaps += hm.depth[i].overlaps;
+    }
+    for ( i = 0; i < NB_PRUNE_RULES; i++ )
+      search.cuts[i] += hm.cuts[i];
+    search.lookups += hm.lookups;
+    search.hits += hm.hits;
+    hm.lookups = hm.hits = 0;
+    if ( hm.firstSolution >= 0 && ( search.firstSolution < 0 || hm.firstSolution < search.firstSolution ) )
+      search.firstSolution = hm.firstSolution;
+    memcpy( t->orbits, hm.orbits, sizeof(hm.orbits) );
+    t->energy = hm.energy;
+    hm.energy.counts = NULL;
+    hm.energy.stride = 0;
+    t->done = 1;
+    hm.task = NULL;
+    while ( search.next < search.nbTasks && search.tasks[ search.next ].done )
+      writeTask( search.next++ );
+    pthread_mutex_unlock( &search.streamLock );
+  }
+  registerWalk( id, NULL );
+  if ( globalArgs.checkpointFileName )
+  {
+    pthread_mutex_lock( &checkpoint.lock );
+    checkpoint.running--;
+    pthread_cond_signal( &checkpoint.wake );
+    pthread_mutex_unlock( &checkpoint.lock );
+  }
+  destroy_hm();
+  return NULL;
+}
+
+/* Deals the tasks to the queues and runs the threads on them */
+static void runTasks(void *(*thread)(void *))
+{
+  int i;
+  pthread_t *threads = malloc( sizeof(pthread_t) * globalArgs.threads );
+  search.queues = malloc( sizeof(struct taskQueue_t) * globalArgs.threads );
+  if ( ! threads || ! search.queues )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for ( i = 0; i < globalArgs.threads; i++ )
+  {
+    struct taskQueue_t *q = &search.queues[i];
+    pthread_mutex_init( &q->lock, NULL );
+    q->tasks = malloc( sizeof(int) * ( search.nbTasks / globalArgs.threads + 1 ) );
+    q->head = q->tail = 0;
+    if ( ! q->tasks )
+    {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for ( i = 0; i < search.nbTasks; i++ )
+  {
+    struct taskQueue_t *q = &search.queues[ i % globalArgs.threads ];
+    q->tasks[ q->tail++ ] = i;
+  }
+
+  for ( i = 0; i < globalArgs.threads; i++ )
+    if ( pthread_create( &threads[i], NULL, thread, (void *) (intptr_t) i ) )
+    {
+      fprintf(stderr, "Could not start search thread %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  for ( i = 0; i < globalArgs.threads; i++ )
+    pthread_join( threads[i], NULL );
+
+  for ( i = 0; i < globalArgs.threads; i++ )
+  {
+    pthread_mutex_destroy( &search.queues[i].lock );
+    free( search.queues[i].tasks );
+  }
+  free( search.queues );
+  free( threads );
+}
+
+int parallelSearch()
+{
+  pthread_mutex_init( &search.streamLock, NULL );
+  search.depth = calloc( nbElements, sizeof(struct depthCount_t) );
+  if ( ! search.depth )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  search.started = hm.started;
+  search.firstSolution = -1;
+
+  /* The cut has to come before the last element, where the solutions are.
+   * Without room for it the whole search is one task. A search resumed
+   * from a checkpoint has the tasks of its frontier. */
+  if ( globalArgs.splitDepth + 1 > nbElements - 2 )
+    globalArgs.splitDepth = nbElements - 3;
+  if ( globalArgs.splitDepth > 0 && ! globalArgs.resumeFileName )
+  {
+    hm.frontier = globalArgs.splitDepth + 1;
+    searchFromRoot();
+    hm.frontier = 0;
+    search.nodes = hm.nodes;
+    energyMerge( &search.energy, &hm.energy );
+    memcpy( search.depth, hm.depth, sizeof(struct depthCount_t) * nbElements );
+    memcpy( search.cuts, hm.cuts, sizeof(hm.cuts) );
+  }
+  else if ( ! globalArgs.resumeFileName )
+  {
+    newTask();
+  }
+  if ( globalArgs.verbose )
+    fprintf(stderr, "%d tasks for %d threads\n", search.nbTasks, globalArgs.threads);
+
+  if ( globalArgs.checkpointFileName )
+    startCheckpoints();
+  runTasks( searchThread );
+  if ( globalArgs.checkpointFileName )
+    stopCheckpoints();
+  pthread_mutex_destroy( &search.streamLock );
+  free( search.tasks );
+  return search.written;
+}
+
+/*
+ * Checkpoints (-C, -r, -x).
+ * Every -C seconds a timer thread asks the search threads to stop at their
+ * next node, or between two tasks, and writes the frontier of the search:
+ * the subtrees not searched yet, each as the directions of the elements
+ * down to its root and how many of them were walked and counted. These are
+ * the tasks not written yet and, when the solutions are only counted, the
+ * children left to try in the walks of the tasks being searched, so little
+ * is searched again. With an output the solutions of a task are written
+ * once it is finished, so its walk has to start over. The frontier comes
+ * with the sequence, the box, and the solutions, nodes and histogram of -E of the search
+ * before it, and the checkpoint is written to a new file that then replaces
+ * the old one, so a search killed at any time leaves a whole checkpoint.
+ * A search resumed with -r searches the subtrees of the frontier as tasks,
+ * with the counts of the checkpoint to start from, and goes on with the
+ * stream of -o from where the checkpoint left it. Every subtree is searched
+ * once, and the last checkpoint, at the end of the search, has an empty
+ * frontier and the totals. The counts of the checks of -p and of the table
+ * of -m start over.
+ * The lines of the frontier can be dealt to other machines: -x n writes n
+ * checkpoints with every n-th subtree, the counts going to the first one.
+ * Their totals add up to the ones of the whole search.
+ */
+
+#define CHECKPOINT_MAGIC "cube-checkpoint 1"
+
+/* The header of a checkpoint, up to the frontier */
+static void writeCheckpointHeader(FILE *f, int solutions, long nodes, const long *orbits,
+                                  const struct energy_t *energy, long output)
+{
+  int i, r;
+  int *b = globalArgs.boundingBox;
+  fprintf( f, "%s\nsequence ", CHECKPOINT_MAGIC );
+  for ( i = 0; i < nbElements; i++ )
+    fprintf( f, i ? ",%d" : "%d", Sequence[i] );
+  if ( b[0] > 0 )
+    fprintf( f, "\nbox %dx%dx%d", b[0], b[1], b[2] );
+  else
+    fprintf( f, "\nbox %s", b[0] ? "cube" : "0" );
+  fprintf( f, "\nspecular %d\nsolutions %d\nnodes %ld\norbits", globalArgs.specular, solutions, nodes );
+  for ( i = 1; i <= 48; i++ )
+    fprintf( f, " %ld", orbits[i] );
+  fprintf( f, "\n" );
+  for ( r = 0; energy->counts && r < nbElements + 2; r++ )
+  {
+    long *row = energy->counts + (size_t) r * energy->stride;
+    int n = energy->stride;
+    while ( n > 0 && ! row[ n - 1 ] )
+      n--;
+    if ( ! n )
+      continue;
+    fprintf( f, "energy %d", r );
+    for ( i = 0; i < n; i++ )
+      fprintf( f, " %ld", row[i] );
+    fprintf( f, "\n" );
+  }
+  if ( output >= 0 )
+    fprintf( f, "output %ld\n", output );
+}
+
+/* The subtree of a task, from the root when it has no path */
+static void writeTaskPath(FILE *f, struct task_t *t)
+{
+  if ( t->path )
+    fprintf( f, "%.*s %d\n", t->pathEnd + 1, t->path, t->counted + 1 );
+  else
+    fprintf( f, "XY 2\n" );
+}
+
+/* The children left to try in the walk w, the deepest first as the search
+ * takes them. The ones above the path of its task belong to other tasks. */
+static void writeWalkFrontier(FILE *f, struct HamiltonianWalk_t *w)
+{
+  int e, c;
+  for ( e = w->last_element; e >= w->pathEnd && e >= 1; e-- )
+  {
+    struct frame_t *s = &w->stack[ e - 1 ];
+    for ( c = s->next; c < s->nbChildren; c++ )
+      fprintf( f, "%.*s%c %d\n", e + 1, w->dirs, s->children[c], e + 1 );
+  }
+}
+
+/* Whether the walk w, above the end of the path of its task, is back from
+ * the subtree of the task rather than on its way down to it */
+static int pathSearched(struct HamiltonianWalk_t *w)
+{
+  struct frame_t *s = &w->stack[ w->last_element - 1 ];
+  const char *c = memchr( s->children, w->path[ w->last_element + 1 ], s->nbChildren );
+  return ! c || c - s->children < s->next;
+}
+
+/* Writes the checkpoint of -C. Runs with all the search threads stopped. */
+static void writeCheckpoint()
+{
+  int i, k;
+  int solutions = search.written;
+  long nodes = search.nodes;
+  long orbits[49];
+  long output = -1;
+  struct energy_t energy = { NULL, 0 };
+  memcpy( orbits, search.orbits, sizeof(orbits) );
+  energyMerge( &energy, &search.energy );
+  struct HamiltonianWalk_t **walks = calloc( search.nbTasks + 1, sizeof(struct HamiltonianWalk_t *) );
+  if ( ! walks )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  for ( i = 0; i < progress.nbWalkers; i++ )
+    if ( progress.walkers[i] && progress.walkers[i]->task )
+      walks[ progress.walkers[i]->task - search.tasks ] = progress.walkers[i];
+
+  /* The tasks finished but not written are searched again, and so are the
+   * ones being searched when there is an output */
+  for ( i = search.next; i < search.nbTasks; i++ )
+    if ( search.tasks[i].done )
+      nodes -= search.tasks[i].nodes;
+    else if ( walks[i] && ! globalArgs.output )
+    {
+      solutions += walks[i]->solutions;
+      nodes += walks[i]->nodes;
+      for ( k = 1; k <= 48; k++ )
+        orbits[k] += walks[i]->orbits[k];
+      energyMerge( &energy, &walks[i]->energy );
+    }
+  if ( globalArgs.output )
+    fflush( globalArgs.outFile );
+  if ( globalArgs.output && globalArgs.outFileName )
+    output = ftell( globalArgs.outFile );
+
+  char fileName[ strlen( globalArgs.checkpointFileName ) + 5 ];
+  sprintf( fileName, "%s.new", globalArgs.checkpointFileName );
+  FILE *f = fopen( fileName, "w" );
+  if ( ! f )
+  {
+    fprintf(stderr, "Could not open %s to write\n", fileName);
+    free( energy.counts );
+    free( walks );
+    return;
+  }
+  writeCheckpointHeader( f, solutions, nodes, orbits, &energy, output );
+  for ( i = search.next; i < search.nbTasks; i++ )
+  {
+    struct HamiltonianWalk_t *w = walks[i];
+    if ( w && ! globalArgs.output && w->last_element >= w->pathEnd )
+      writeWalkFrontier( f, w );
+    else if ( ! w || globalArgs.output || ! pathSearched( w ) )
+      writeTaskPath( f, &search.tasks[i] );
+  }
+  fprintf( f, "end\n" );
+  if ( fclose( f ) || rename( fileName, globalArgs.checkpointFileName ) )
+    fprintf(stderr, "Could not write %s\n", globalArgs.checkpointFileName);
+  else if ( globalArgs.verbose )
+    fprintf(stderr, "Checkpoint written to %s\n", globalArgs.checkpointFileName);
+  free( energy.counts );
+  free( walks );
+}
+
+static void checkpointStop()
+{
+  pthread_mutex_lock( &checkpoint.lock );
+  checkpoint.stopped++;
+  pthread_cond_signal( &checkpoint.wake );
+  while ( checkpoint.requested )
+    pthread_cond_wait( &checkpoint.resume, &checkpoint.lock );
+  checkpoint.stopped--;
+  pthread_mutex_unlock( &checkpoint.lock );
+}
+
+static void *checkpointThread(void *arg)
+{
+  struct timespec deadline;
+  (void) arg;
+  clock_gettime( CLOCK_REALTIME, &deadline );
+  pthread_mutex_lock( &checkpoint.lock );
+  while ( ! checkpoint.ended )
+  {
+    long step = globalArgs.checkpointInterval * 1e9;
+    deadline.tv_sec += ( deadline.tv_nsec + step ) / 1000000000;
+    deadline.tv_nsec = ( deadline.tv_nsec + step ) % 1000000000;
+    while ( ! checkpoint.ended
+            && pthread_cond_timedwait( &checkpoint.wake, &checkpoint.lock, &deadline ) != ETIMEDOUT )
+      ;
+    if ( checkpoint.ended )
+      break;
+    checkpoint.requested = 1;
+    while ( checkpoint.stopped < checkpoint.running )
+      pthread_cond_wait( &checkpoint.wake, &checkpoint.lock );
+    writeCheckpoint();
+    checkpoint.requested = 0;
+    pthread_cond_broadcast( &checkpoint.resume );
+  }
+  pthread_mutex_unlock( &checkpoint.lock );
+  return NULL;
+}
+
+/* Starts the timer of -C for the threads of runTasks */
+static void startCheckpoints()
+{
+  pthread_mutex_init( &checkpoint.lock, NULL );
+  pthread_cond_init( &checkpoint.wake, NULL );
+  pthread_cond_init( &checkpoint.resume, NULL );
+  checkpoint.running = globalArgs.threads;
+  if ( pthread_create( &checkpoint.timer, NULL, checkpointThread, NULL ) )
+  {
+    fprintf(stderr, "Could not start the checkpoint thread\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Stops the timer and writes the last checkpoint, with the totals */
+static void stopCheckpoints()
+{
+  pthread_mutex_lock( &checkpoint.lock );
+  checkpoint.ended = 1;
+  pthread_cond_signal( &checkpoint.wake );
+  pthread_mutex_unlock( &checkpoint.lock );
+  pthread_join( checkpoint.timer, NULL );
+  writeCheckpoint();
+  pthread_cond_destroy( &checkpoint.resume );
+  pthread_cond_destroy( &checkpoint.wake );
+  pthread_mutex_destroy( &checkpoint.lock );
+}
+
+/* Task of a line of the frontier: its directions and how many of them were
+ * walked. Returns 0 if the line is not one. */
+static int readFrontierTask(const char *dirs, const char *walked)
+{
+  int i, n = strlen( dirs );
+  char *end;
+  long w = strtol( walked, &end, 10 );
+  if ( end == walked || *end || n < 2 || n > nbElements || w < 2 || w < n - 1 || w > n
+       || dirs[0] != 'X' || dirs[1] != 'Y' )
+    return 0;
+  for ( i = 0; i < n; i++ )
+    if ( ! strchr( dirChar, dirs[i] ) )
+      return 0;
+  struct task_t *t = newTask();
+  t->path = malloc( n );
+  if ( ! t->path )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy( t->path, dirs, n );
+  t->pathEnd = n - 1;
+  t->counted = w - 1;
+  return 1;
+}
+
+void readCheckpoint(const char *fileName)
+{
+  FILE *f = fopen( fileName, "r" );
+  if ( ! f )
+  {
+    fprintf(stderr, "Could not open %s to read\n", fileName);
+    exit(EXIT_FAILURE);
+  }
+  char *line = NULL;
+  size_t size = 0;
+  int lineNumber = 0, ended = 0, i;
+  nbElements = 0;
+  while ( getline( &line, &size, f ) != -1 )
+  {
+    lineNumber++;
+    line[ strcspn( line, "\n" ) ] = '\0';
+    if ( lineNumber == 1 )
+    {
+      if ( strcmp( line, CHECKPOINT_MAGIC ) )
+      {
+        fprintf(stderr, "%s is not a checkpoint\n", fileName);
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    char *value = strchr( line, ' ' );
+    char *end = NULL;
+    int ok = 1;
+    if ( ! value )
+      value = line + strlen( line );
+    else
+      *value++ = '\0';
+    if ( ended )
+      ok = 0;
+    else if ( line[0] && strchr( dirChar, line[0] ) )
+      ok = nbElements > 0 && readFrontierTask( line, value );
+    else if ( ! strcmp( line, "sequence" ) )
+      ok = ( nbElements = parseSequence( value, &Sequence ) ) > 0;
+    else if ( ! strcmp( line, "box" ) )
+    {
+      if ( ! strcmp( value, "cube" ) )
+        globalArgs.boundingBox[0] = -1;
+      else
+        ok = ! parseBox( value, globalArgs.boundingBox );
+    }
+    else if ( ! strcmp( line, "specular" ) )
+      ok = ( globalArgs.specular = strtol( value, &end, 10 ) ) >= 0 && globalArgs.specular <= 1;
+    else if ( ! strcmp( line, "solutions" ) )
+      ok = ( search.written = strtol( value, &end, 10 ) ) >= 0;
+    else if ( ! strcmp( line, "nodes" ) )
+      ok = ( search.nodes = strtol( value, &end, 10 ) ) >= 0;
+    else if ( ! strcmp( line, "output" ) )
+      ok = ( checkpoint.output = strtol( value, &end, 10 ) ) >= 0;
+    else if ( ! strcmp( line, "orbits" ) )
+      for ( i = 1, end = value; i <= 48 && ok; i++ )
+      {
+        char *from = end;
+        search.orbits[i] = strtol( from, &end, 10 );
+        ok = end > from && search.orbits[i] >= 0;
+      }
+    else if ( ! strcmp( line, "energy" ) )
+    {
+      int row = strtol( value, &end, 10 );
+      ok = end > value && row >= 0 && row < nbElements + 2 && nbElements > 0;
+      for ( i = 0; ok && *end; i++ )
+      {
+        char *from = end;
+        long n = strtol( from, &end, 10 );
+        ok = end > from && n >= 0;
+        if ( ok && n )
+          energyAdd( &search.energy, row, i, n );
+      }
+    }
+    else if ( ! strcmp( line, "end" ) )
+      ended = 1;
+    else
+      ok = 0;
+    if ( ! ok || ( end && ( end == value || *end ) ) )
+    {
+      fprintf(stderr, "%s:%d: not a line of a checkpoint\n", fileName, lineNumber);
+      exit(EXIT_FAILURE);
+    }
+  }
+  free( line );
+  fclose( f );
+  if ( ! ended || nbElements <= 0 )
+  {
+    fprintf(stderr, "%s is not a whole checkpoint\n", fileName);
+    exit(EXIT_FAILURE);
+  }
+  checkpoint.nodes = search.nodes;
+}
+
+void splitCheckpoint(const char *fileName, int n)
+{
+  int i, k;
+  long none[49] = { 0 };
+  struct energy_t empty = { NULL, 0 };
+  for ( k = 0; k < n; k++ )
+  {
+    char pieceName[ strlen( fileName ) + 16 ];
+    sprintf( pieceName, "%s.%d", fileName, k + 1 );
+    FILE *f = fopen( pieceName, "w" );
+    if ( ! f )
+    {
+      fprintf(stderr, "Could not open %s to write\n", pieceName);
+      exit(EXIT_FAILURE);
+    }
+    if ( k )
+      writeCheckpointHeader( f, 0, 0, none, &empty, -1 );
+    else
+      writeCheckpointHeader( f, search.written, search.nodes, search.orbits, &search.energy, checkpoint.output );
+    for ( i = k; i < search.nbTasks; i += n )
+      writeTaskPath( f, &search.tasks[i] );
+    fprintf( f, "end\n" );
+    if ( fclose( f ) )
+    {
+      fprintf(stderr, "Could not write %s\n", pieceName);
+      exit(EXIT_FAILURE);
+    }
+  }
+  fprintf(stderr, "Frontier of %d subtrees split into %s.1 to %s.%d\n", search.nbTasks, fileName, fileName, n);
+}
+
+/*
+ * Exact cover engine.
+ * With -e dlx the fold is solved as an exact cover problem with colours
+ * (Knuth's Algorithm C, dancing links). An option places one element: its
+ * direction and the cell it starts from in the box. It covers
+ *  - the item of the element and the items of the cells it walks (all but
+ *    the one it starts from, save for the first element);
+ *  - the junctions with the elements before and after it, secondary items
+ *    coloured with the cell they meet in, so that an element starts where
+ *    the one before it ends;
+ *  - the axes at these junctions, secondary items without colour, so that
+ *    two elements in a row do not walk along the same axis.
+ * The items are chosen with the fewest options left first. As in the DFS,
+ * the first two elements are only walked in +X and +Y; the solutions whose
+ * first step in Z is in -Z are the mirror images of others and are dropped
+ * unless -s. The solutions are then sorted in the order of the DFS, so the
+ * output is the same.
+ */
+
+struct dlx_t {
+  int nbItems;                /* Items 1..nbPrimary are primary */
+  int nbPrimary;
+  int * llink;                /* Active items, 0 heads the primary ones */
+  int * rlink;
+  int * len;                  /* Options left of each item */
+  int * top;                  /* Nodes: the headers of the items, then the */
+  int * ulink;                /* options separated by spacers */
+  int * dlink;
+  int * color;
+  int nbNodes;
+  int maxNodes;
+  int nbOptions;
+  int * element;              /* Element, direction and start of each option */
+  int * dir;
+  int * start;
+  int * choice;               /* Option chosen at each level */
+  unsigned char * solutions;  /* Solutions kept for sorting, recordSize bytes each */
+  long nbSolutions;
+  long maxSolutions;
+};
+
+/* Record of a kept solution: the child taken at every element after the
+ * first two in the order of the DFS, the directions, and the orbit */
+static __thread int dlxKeySize;
+
+static int compareSolutions(const void *a, const void *b)
+{
+  return memcmp( a, b, dlxKeySize );
+}
+
+static void dlxAppend(struct dlx_t *x, int item, int color)
+{
+  if ( x->nbNodes == x->maxNodes )
+  {
+    x->maxNodes *= 2;
+    x->top = realloc( x->top, sizeof(int) * x->maxNodes );
+    x->ulink = realloc( x->ulink, sizeof(int) * x->maxNodes );
+    x->dlink = realloc( x->dlink, sizeof(int) * x->maxNodes );
+    x->color = realloc( x->color, sizeof(int) * x->maxNodes );
+    if ( ! x->top || ! x->ulink || ! x->dlink || ! x->color )
+    {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  int k = x->nbNodes++;
+  x->top[k] = item;
+  x->color[k] = color;
+  if ( item <= 0 )
+    return;
+  x->ulink[k] = x->ulink[item];
+  x->dlink[k] = item;
+  x->dlink[ x->ulink[item] ] = k;
+  x->ulink[item] = k;
+  x->len[item]++;
+}
+
+/* Ends the option being added with a spacer */
+static void dlxEndOption(struct dlx_t *x, int element, int dir, int start)
+{
+  int first = x->nbNodes - 1;
+  while ( x->top[ first - 1 ] > 0 )
+    first--;
+  x->dlink[ first - 1 ] = x->nbNodes - 1;
+  dlxAppend( x, -( x->nbOptions + 1 ), 0 );
+  x->ulink[ x->nbNodes - 1 ] = first;
+  if ( x->nbOptions % 1024 == 0 )
+  {
+    x->element = realloc( x->element, sizeof(int) * ( x->nbOptions + 1024 ) );
+    x->dir = realloc( x->dir, sizeof(int) * ( x->nbOptions + 1024 ) );
+    x->start = realloc( x->start, sizeof(int) * ( x->nbOptions + 1024 ) );
+    if ( ! x->element || ! x->dir || ! x->start )
+    {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  x->element[ x->nbOptions ] = element;
+  x->dir[ x->nbOptions ] = dir;
+  x->start[ x->nbOptions ] = start;
+  x->nbOptions++;
+}
+
+static void dlxBuild(struct dlx_t *x)
+{
+  int side = hm.box, cells = side * side * side, n = hm.nbElements;
+  int i, k, d, c;
+  /* Cells, elements, then the junctions and their axes */
+  x->nbPrimary = cells + n;
+  x->nbItems = x->nbPrimary + 4 * ( n - 1 );
+  x->llink = malloc( sizeof(int) * ( x->nbItems + 2 ) );
+  x->rlink = malloc( sizeof(int) * ( x->nbItems + 2 ) );
+  x->len = calloc( x->nbItems + 1, sizeof(int) );
+  x->maxNodes = 1024 + x->nbItems;
+  x->top = malloc( sizeof(int) * x->maxNodes );
+  x->ulink = malloc( sizeof(int) * x->maxNodes );
+  x->dlink = malloc( sizeof(int) * x->maxNodes );
+  x->color = malloc( sizeof(int) * x->maxNodes );
+  x->choice = malloc( sizeof(int) * ( x->nbPrimary + 1 ) );
+  if ( ! x->llink || ! x->rlink || ! x->len || ! x->top || ! x->ulink || ! x->dlink
+       || ! x->color || ! x->choice )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  x->element = x->dir = x->start = NULL;
+  x->nbOptions = 0;
+  x->solutions = NULL;
+  x->nbSolutions = x->maxSolutions = 0;
+  for ( i = 0; i <= x->nbItems; i++ )
+  {
+    x->llink[i] = i - 1;
+    x->rlink[i] = i + 1;
+    x->top[i] = x->ulink[i] = x->dlink[i] = i;
+    x->color[i] = 0;
+  }
+  /* The primary items in the list headed by 0, the secondary ones in the
+   * list headed by nbItems + 1 */
+  x->llink[0] = x->nbPrimary;
+  x->rlink[ x->nbPrimary ] = 0;
+  x->llink[ x->nbPrimary + 1 ] = x->nbItems + 1;
+  x->rlink[ x->nbItems ] = x->nbItems + 1;
+  x->llink[ x->nbItems + 1 ] = x->nbItems;
+  x->rlink[ x->nbItems + 1 ] = x->nbPrimary + 1;
+  x->nbNodes = x->nbItems + 1;
+  dlxAppend( x, 0, 0 );
+
+  static const int step[6][3] = { {1,0,0}, {-1,0,0}, {0,1,0}, {0,-1,0}, {0,0,1}, {0,0,-1} };
+  for ( i = 0; i < n; i++ )
+    for ( d = 0; d < 6; d++ )
+    {
+      if ( ( i == 0 && d != 0 ) || ( i == 1 && d != 2 ) )
+        continue;
+      int length = hm.seq[i] - 1;
+      for ( c = 0; c < cells; c++ )
+      {
+        int x0 = c % side, y0 = c / side % side, z0 = c / side / side;
+        int x1 = x0 + length * step[d][0], y1 = y0 + length * step[d][1], z1 = z0 + length * step[d][2];
+        if ( x1 < 0 || x1 >= side || y1 < 0 || y1 >= side || z1 < 0 || z1 >= side )
+          continue;
+        dlxAppend( x, cells + i + 1, 0 );
+        for ( k = i ? 1 : 0; k <= length; k++ )
+          dlxAppend( x, 1 + ( x0 + k * step[d][0] ) + side * ( ( y0 + k * step[d][1] ) + side * ( z0 + k * step[d][2] ) ), 0 );
+        int end = x1 + side * ( y1 + side * z1 );
+        /* Junction i-1 (before) and i (after), and their axes */
+        if ( i > 0 )
+        {
+          dlxAppend( x, x->nbPrimary + 1 + 4 * ( i - 1 ), c + 1 );
+          dlxAppend( x, x->nbPrimary + 2 + 4 * ( i - 1 ) + ( d >> 1 ), 0 );
+        }
+        if ( i < n - 1 )
+        {
+          dlxAppend( x, x->nbPrimary + 1 + 4 * i, end + 1 );
+          dlxAppend( x, x->nbPrimary + 2 + 4 * i + ( d >> 1 ), 0 );
+        }
+        dlxEndOption( x, i, d, c );
+      }
+    }
+}
+
+static void dlxFree(struct dlx_t *x)
+{
+  free( x->llink );
+  free( x->rlink );
+  free( x->len );
+  free( x->top );
+  free( x->ulink );
+  free( x->dlink );
+  free( x->color );
+  free( x->choice );
+  free( x->element );
+  free( x->dir );
+  free( x->start );
+  free( x->solutions );
+}
+
+static inline void dlxHide(struct dlx_t *x, int p)
+{
+  int q = p + 1;
+  while ( q != p )
+  {
+    int i = x->top[q], u = x->ulink[q], d = x->dlink[q];
+    if ( i <= 0 )
+      q = u;
+    else
+    {
+      if ( x->color[q] >= 0 )
+      {
+        x->dlink[u] = d;
+        x->ulink[d] = u;
+        x->len[i]--;
+      }
+      q++;
+    }
+  }
+}
+
+static inline void dlxUnhide(struct dlx_t *x, int p)
+{
+  int q = p - 1;
+  while ( q != p )
+  {
+    int i = x->top[q], u = x->ulink[q], d = x->dlink[q];
+    if ( i <= 0 )
+      q = d;
+    else
+    {
+      if ( x->color[q] >= 0 )
+      {
+        x->dlink[u] = q;
+        x->ulink[d] = q;
+        x->len[i]++;
+      }
+      q--;
+    }
+  }
+}
+
+static inline void dlxCover(struct dlx_t *x, int i)
+{
+  int p;
+  for ( p = x->dlink[i]; p != i; p = x->dlink[p] )
+    dlxHide( x, p );
+  x->rlink[ x->llink[i] ] = x->rlink[i];
+  x->llink[ x->rlink[i] ] = x->llink[i];
+}
+
+static inline void dlxUncover(struct dlx_t *x, int i)
+{
+  int p;
+  x->rlink[ x->llink[i] ] = i;
+  x->llink[ x->rlink[i] ] = i;
+  for ( p = x->ulink[i]; p != i; p = x->ulink[p] )
+    dlxUnhide( x, p );
+}
+
+/* Keeps only the options of the item of p that give it the colour of p */
+static inline void dlxPurify(struct dlx_t *x, int p)
+{
+  int c = x->color[p], i = x->top[p], q;
+  for ( q = x->dlink[i]; q != i; q = x->dlink[q] )
+    if ( x->color[q] == c )
+      x->color[q] = -1;
+    else
+      dlxHide( x, q );
+}
+
+static inline void dlxUnpurify(struct dlx_t *x, int p)
+{
+  int c = x->color[p], i = x->top[p], q;
+  for ( q = x->ulink[i]; q != i; q = x->ulink[q] )
+    if ( x->color[q] < 0 )
+      x->color[q] = c;
+    else
+      dlxUnhide( x, q );
+}
+
+static inline void dlxCommit(struct dlx_t *x, int p, int j)
+{
+  if ( x->color[p] == 0 )
+    dlxCover( x, j );
+  else if ( x->color[p] > 0 )
+    dlxPurify( x, p );
+}
+
+static inline void dlxUncommit(struct dlx_t *x, int p, int j)
+{
+  if ( x->color[p] == 0 )
+    dlxUncover( x, j );
+  else if ( x->color[p] > 0 )
+    dlxUnpurify( x, p );
+}
+
+/* An exact cover was found: the fold it gives, if it is not a copy */
+static void dlxSolution(struct dlx_t *x, int level)
+{
+  int l, i;
+  for ( l = 0; l < level; l++ )
+  {
+    int p = x->choice[l];
+    while ( x->top[p] > 0 )
+      p++;
+    int o = -x->top[p] - 1;
+    hm.dirs[ x->element[o] ] = dirChar[ x->dir[o] ];
+  }
+  if ( ! globalArgs.specular )
+  {
+    for ( i = 0; i < hm.nbElements; i++ )
+    {
+      if ( hm.dirs[i] == 'z' )
+        return;
+      else if ( hm.dirs[i] == 'Z' )
+        break;
+    }
+  }
+  int orbit = solutionOrbit();
+  if ( ! orbit )
+    return;
+  if ( hm.firstSolution < 0 )
+    firstSolutionFound();
+  if ( globalArgs.countOnly && ! globalArgs.maxSolutions )
+  {
+    hm.solutions++;
+    hm.orbits[orbit]++;
+    return;
+  }
+
+  int size = 2 * hm.nbElements - 1;
+  if ( x->nbSolutions == x->maxSolutions )
+  {
+    x->maxSolutions = x->maxSolutions ? 2 * x->maxSolutions : 1024;
+    x->solutions = realloc( x->solutions, size * x->maxSolutions );
+    if ( ! x->solutions )
+    {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  unsigned char *r = x->solutions + size * x->nbSolutions++;
+  for ( i = 2; i < hm.nbElements; i++ )
+  {
+    static const char *children[3] = { "YyZz", "XxZz", "XxYy" };
+    int axis = ( strchr( dirChar, hm.dirs[i-1] ) - dirChar ) >> 1;
+    r[ i - 2 ] = strchr( children[axis], hm.dirs[i] ) - children[axis];
+  }
+  memcpy( r + hm.nbElements - 2, hm.dirs, hm.nbElements );
+  r[ size - 1 ] = orbit;
+}
+
+static void dlxSearch(struct dlx_t *x, int level)
+{
+  if ( x->rlink[0] == 0 )
+  {
+    dlxSolution( x, level );
+    return;
+  }
+  /* The item with the fewest options left */
+  int i, best = x->rlink[0];
+  for ( i = x->rlink[best]; i != 0 && x->len[best] > 1; i = x->rlink[i] )
+    if ( x->len[i] < x->len[best] )
+      best = i;
+  if ( x->len[best] == 0 )
+    return;
+
+  int p, o;
+  dlxCover( x, best );
+  for ( o = x->dlink[best]; o != best; o = x->dlink[o] )
+  {
+    hm.nodes++;
+    x->choice[level] = o;
+    for ( p = o + 1; p != o; )
+    {
+      int j = x->top[p];
+      if ( j <= 0 )
+        p = x->ulink[p];
+      else
+      {
+        dlxCommit( x, p, j );
+        p++;
+      }
+    }
+    dlxSearch( x, level + 1 );
+    for ( p = o - 1; p != o; )
+    {
+      int j = x->top[p];
+      if ( j <= 0 )
+        p = x->dlink[p];
+      else
+      {
+        dlxUncommit( x, p, j );
+        p--;
+      }
+    }
+  }
+  dlxUncover( x, best );
+}
+
+int fillsBox()
+{
+  return hm.box && hm.cubic && hm.MAX_length == hm.box * hm.box * hm.box;
+}
+
+void solveExactCover()
+{
+  struct dlx_t x;
+  long i;
+  dlxBuild( &x );
+  if ( globalArgs.verbose )
+    fprintf(stderr, "Exact cover: %d items, %d options, %d nodes\n", x.nbItems, x.nbOptions, x.nbNodes);
+  dlxSearch( &x, 0 );
+
+  /* The solutions kept, in the order of the DFS and up to -M */
+  int size = 2 * hm.nbElements - 1;
+  dlxKeySize = hm.nbElements - 2;
+  qsort( x.solutions, x.nbSolutions, size, compareSolutions );
+  for ( i = 0; i < x.nbSolutions; i++ )
+  {
+    unsigned char *r = x.solutions + size * i;
+    if ( globalArgs.maxSolutions && hm.solutions == globalArgs.maxSolutions )
+      break;
+    hm.solutions++;
+    hm.orbits[ r[ size - 1 ] ]++;
+    if ( globalArgs.output )
+    {
+      memcpy( hm.dirs, r + hm.nbElements - 2, hm.nbElements );
+      walkDirections();
+      writeSolution( globalArgs.outFile );
+    }
+  }
+  dlxFree( &x );
+}
+
+/*
+ * Sequences.
+ * A sequence is given as the lengths of its elements separated by commas or
+ * blanks. A file of sequences has one per line; blank lines and what follows
+ * a '#' are skipped.
+ */
+
+int parseSequence(const char *text, int **seq)
+{
+  int n = 0, max = 0;
+  int *s = NULL;
+  const char *p = text;
+  for (;;)
+  {
+    while ( *p == ',' || isspace( (unsigned char) *p ) )
+      p++;
+    if ( ! *p )
+      break;
+    char *end;
+    long length = strtol( p, &end, 10 );
+    if ( end == p || length < 2 || length > 1000000 )
+    {
+      free( s );
+      return -1;
+    }
+    if ( n == max )
+    {
+      max = max ? 2 * max : 32;
+      s = realloc( s, sizeof(int) * max );
+      if ( ! s )
+      {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    s[n++] = length;
+    p = end;
+  }
+  /* The first two elements are placed before the search starts */
+  if ( n < 3 )
+  {
+    free( s );
+    return -1;
+  }
+  *seq = s;
+  return n;
+}
+
+void readSequences(const char *fileName)
+{
+  FILE *f = fopen( fileName, "r" );
+  if ( ! f )
+  {
+    fprintf(stderr, "Could not open %s to read\n", fileName);
+    exit(EXIT_FAILURE);
+  }
+  char *line = NULL;
+  size_t size = 0;
+  int lineNumber = 0;
+  int max = 0;
+  while ( getline( &line, &size, f ) != -1 )
+  {
+    lineNumber++;
+    char *comment = strchr( line, '#' );
+    if ( comment )
+      *comment = '\0';
+    char *p = line;
+    while ( isspace( (unsigned char) *p ) )
+      p++;
+    if ( ! *p )
+      continue;
+    if ( nbSequences == max )
+    {
+      max = max ? 2 * max : 1024;
+      sequences = realloc( sequences, sizeof(int *) * max );
+      sequenceLengths = realloc( sequenceLengths, sizeof(int) * max );
+      if ( ! sequences || ! sequenceLengths )
+      {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    sequenceLengths[ nbSequences ] = parseSequence( p, &sequences[ nbSequences ] );
+    if ( sequenceLengths[ nbSequences ] < 0 )
+    {
+      fprintf(stderr, "%s:%d: a sequence is a list of 3 or more lengths of at least 2\n",
+              fileName, lineNumber);
+      exit(EXIT_FAILURE);
+    }
+    nbSequences++;
+  }
+  free( line );
+  fclose( f );
+  if ( ! nbSequences )
+  {
+    fprintf(stderr, "No sequence in %s\n", fileName);
+    exit(EXIT_FAILURE);
+  }
+}
+
+int parseBox(const char *text, int box[3])
+{
+  char *end;
+  int i, t;
+  box[0] = strtol( text, &end, 10 );
+  if ( end == text || box[0] < 0 )
+    return -1;
+  if ( ! *end )
+  {
+    box[1] = box[2] = box[0];
+    return 0;
+  }
+  for ( i = 1; i < 3; i++ )
+  {
+    if ( *end != 'x' )
+      return -1;
+    text = end + 1;
+    box[i] = strtol( text, &end, 10 );
+    if ( end == text || box[i] < 1 )
+      return -1;
+  }
+  if ( *end || box[0] < 1 )
+    return -1;
+  if ( box[0] > box[1] ) t = box[0], box[0] = box[1], box[1] = t;
+  if ( box[1] > box[2] ) t = box[1], box[1] = box[2], box[2] = t;
+  if ( box[0] > box[1] ) t = box[0], box[0] = box[1], box[1] = t;
+  return 0;
+}
+
+int sequenceBox(int *seq, int n, int box[3])
+{
+  int i;
+  int volume = 1;
+  for ( i = 0; i < n; i++ )
+    volume += seq[i] - 1;
+  int cubeSide = is_perfect_cube( volume ) ? round( cbrt( volume ) ) : ceil( cbrt( volume ) );
+  if ( globalArgs.boundingBox[0] == -1 )
+  {
+    box[0] = box[1] = box[2] = cubeSide;
+    return 0;
+  }
+  if ( box != globalArgs.boundingBox )
+    memcpy( box, globalArgs.boundingBox, sizeof(globalArgs.boundingBox) );
+  if ( box[0] && (long) box[0] * box[1] * box[2] < volume )
+    return -1;
+  return 0;
+}
+
+/*
+ * Batch mode.
+ * Every thread takes the next sequence and searches it whole, so the
+ * sequences are shared out as they finish and a long one holds up only its
+ * own thread. The summary line of a sequence is the sequence, its solutions,
+ * the nodes walked and the CPU time, in the order of the file.
+ */
+
+static void *batchThread(void *arg)
+{
+  int id = (int) (intptr_t) arg;
+  int n, i;
+  for (;;)
+  {
+    pthread_mutex_lock( &batch.lock );
+    n = batch.next < nbSequences ? batch.next++ : -1;
+    pthread_mutex_unlock( &batch.lock );
+    if ( n < 0 )
+      break;
+
+    struct batchResult_t r = { 0, 0, 0, -1, 1 };
+    int box[3];
+    if ( sequenceBox( sequences[n], sequenceLengths[n], box ) )
+      fprintf(stderr, "Sequence %d does not fit into the bounding box\n", n + 1);
+    else
+    {
+      struct timespec from, to;
+      clock_gettime( CLOCK_THREAD_CPUTIME_ID, &from );
+      init_hm( sequences[n], sequenceLengths[n], box );
+      registerWalk( id, &hm );
+      if ( globalArgs.exactCover && fillsBox() )
+        solveExactCover();
+      else
+        searchFromRoot();
+      clock_gettime( CLOCK_THREAD_CPUTIME_ID, &to );
+      r.solutions = hm.solutions;
+      r.nodes = hm.nodes;
+      r.firstSolution = hm.firstSolution;
+      r.secs = ( to.tv_sec - from.tv_sec ) + ( to.tv_nsec - from.tv_nsec ) / 1e9;
+      registerWalk( id, NULL );
+      destroy_hm();
+    }
+
+    pthread_mutex_lock( &batch.lock );
+    batch.results[n] = r;
+    batch.nodes += r.nodes;
+    batch.finished++;
+    while ( batch.written < nbSequences && batch.results[ batch.written ].done )
+    {
+      struct batchResult_t *w = &batch.results[ batch.written ];
+      int *seq = sequences[ batch.written ];
+      for ( i = 0; i < sequenceLengths[ batch.written ]; i++ )
+        fprintf( globalArgs.outFile, i ? ",%d" : "%d", seq[i] );
+      fprintf( globalArgs.outFile, " %d %ld %.3f\n", w->solutions, w->nodes, w->secs );
+      batch.written++;
+    }
+    pthread_mutex_unlock( &batch.lock );
+  }
+  return NULL;
+}
+
+void batchSearch()
+{
+  int i;
+  int nbThreads = globalArgs.threads < nbSequences ? globalArgs.threads : nbSequences;
+  pthread_t *threads = malloc( sizeof(pthread_t) * nbThreads );
+  batch.results = calloc( nbSequences, sizeof(struct batchResult_t) );
+  if ( ! threads || ! batch.results )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init( &batch.lock, NULL );
+  for ( i = 0; i < nbThreads; i++ )
+    if ( pthread_create( &threads[i], NULL, batchThread, (void *) (intptr_t) i ) )
+    {
+      fprintf(stderr, "Could not start search thread %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  for ( i = 0; i < nbThreads; i++ )
+    pthread_join( threads[i], NULL );
+  pthread_mutex_destroy( &batch.lock );
+  free( threads );
+}
 
-  hm.length = seq[0] + seq[1] - 2;
-  hm.last_element = 1;
-  hm.last_direction = 'Y';
+/*
+ * Census of a box (-G).
+ * The reverse question: which sequences fold into the box of -b, and in how
+ * many ways. The Hamiltonian paths of the box are walked cell by cell with
+ * the symmetry breaking of the search (the first step in +X, the first turn
+ * in +Y, -z once the walk has left its plane), and every path is cut into
+ * its straight elements. A path walked from the other end is a fold of the
+ * reversed sequence, so a path only counts for its sequence when that does
+ * not read after its reverse, and a sequence that reads the same both ways
+ * drops the copies as the search does: the folds of a sequence are the
+ * solutions that cube -c finds for it. The checks of -p cut the paths as
+ * they cut the walks of elements.
+ * The tree is split after -d elements as in the parallel search, and every
+ * thread counts the sequences of its tasks in a hash table of its own. The
+ * tables are added up at the end and the sequences written in order, one
+ * per line with their folds.
+ */
 
-  hm.max.x = seq[0] - 1;
-  hm.max.y = seq[1] - 1;
-  hm.max.z = 0;
+static uint64_t censusHash(const unsigned char *seq, int n)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int i;
+  for ( i = 0; i < n; i++ )
+    h = ( h ^ seq[i] ) * 0x100000001b3ULL;
+  return h;
+}
 
-  hm.min.x = hm.min.y = hm.min.z = 0;
-  
+/* Adds folds to a sequence of the table */
+static void censusAdd(struct censusTable_t *t, const unsigned char *seq, int n, long folds)
+{
+  long i;
+  if ( 2 * ( t->used + 1 ) > t->size )
+  {
+    /* Doubles the table, or makes the first one */
+    struct censusTable_t old = *t;
+    t->size = old.size ? 2 * old.size : 1024;
+    t->used = 0;
+    t->entries = calloc( t->size, sizeof(struct censusEntry_t) );
+    if ( ! t->entries )
+    {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    for ( i = 0; i < old.size; i++ )
+      if ( old.entries[i].seq )
+      {
+        struct censusEntry_t *e = &old.entries[i];
+        long j = censusHash( e->seq, e->nbElements ) & ( t->size - 1 );
+        while ( t->entries[j].seq )
+          j = ( j + 1 ) & ( t->size - 1 );
+        t->entries[j] = *e;
+        t->used++;
+      }
+    free( old.entries );
+  }
+  i = censusHash( seq, n ) & ( t->size - 1 );
+  for ( ; t->entries[i].seq; i = ( i + 1 ) & ( t->size - 1 ) )
+    if ( t->entries[i].nbElements == n && ! memcmp( t->entries[i].seq, seq, n ) )
+    {
+      t->entries[i].folds += folds;
+      return;
+    }
+  t->entries[i].seq = malloc( n );
+  if ( ! t->entries[i].seq )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy( t->entries[i].seq, seq, n );
+  t->entries[i].nbElements = n;
+  t->entries[i].folds = folds;
+  t->used++;
 }
 
-void destroy_hm()
+/* A path of the census walked to the end of the box */
+static void censusPath(struct censusTable_t *t)
 {
-  free( hm.coord );
+  int n = hm.last_element + 1;
+  int i, cmp = 0;
+  t->paths++;
+  if ( n < 3 )
+    return;
+  for ( i = 0; i < n && ! cmp; i++ )
+    cmp = hm.seq[i] - hm.seq[ n - 1 - i ];
+  /* Counted from the other end */
+  if ( cmp > 0 )
+    return;
+  hm.nbElements = n;
+  hm.reversible = ! cmp;
+  int orbit = solutionOrbit();
+  if ( ! orbit )
+    return;
+  hm.solutions++;
+  hm.orbits[orbit]++;
+  if ( hm.firstSolution < 0 )
+    firstSolutionFound();
+  unsigned char key[n];
+  for ( i = 0; i < n; i++ )
+    key[i] = hm.seq[i];
+  censusAdd( t, key, n, 1 );
 }
 
-void createNode(int dir )
+/* Saves the path walked so far as a task of the census */
+static void censusTask(struct censusStep_t *steps)
 {
-  int elementLength = Sequence[ hm.last_element + 1] - 1;
-  if ( globalArgs.verbose )
+  struct task_t *t = newTask();
+  int i;
+  t->path = malloc( hm.length + 1 );
+  if ( ! t->path )
   {
-    fprintf(stderr, ">>> Entering node %c...\n", dir);
-    fprintf(stderr, "    Trying to walk element #%d (length=%d) in %c\n", hm.last_element+1, elementLength, dir);
-    fprintf(stderr, "    From = %d\n", hm.length + 1);
-    fprintf(stderr, "    To   = %d\n", hm.length + elementLength);
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
   }
+  for ( i = 1; i <= hm.length; i++ )
+    t->path[ i - 1 ] = dirChar[ steps[i].dir ];
+  t->path[ hm.length ] = '\0';
+}
 
-  /* Check that the Hamiltonian walk wouldn't be outside bounds */
-  if ( globalArgs.boundingBox )
+/* Takes the last cell out of the path */
+static inline __attribute__((always_inline)) void censusBack(struct censusStep_t *steps, const int side)
+{
+  struct coordinates_t c = hm.coord[ hm.length ];
+  int b = cellBit( c.x, c.y, c.z, side );
+  hm.occupied[ b >> 6 ] &= ~( 1ULL << ( b & 63 ) );
+  if ( hm.seq[ hm.last_element ] == 2 )
+    hm.last_element--;
+  else
+    hm.seq[ hm.last_element ]--;
+  hm.min = steps[ hm.length ].min;
+  hm.max = steps[ hm.length ].max;
+  hm.length--;
+}
+
+/* Walks the paths of the box from its first cell, down the directions of
+ * path first if there is one. With cut, the paths are saved as tasks when
+ * they start element cut instead. */
+static inline __attribute__((always_inline)) void censusWalk(struct censusTable_t *t, const char *path,
+                                                             int cut, const int side)
+{
+  static const int d[6][3] = { {1,0,0}, {-1,0,0}, {0,1,0}, {0,-1,0}, {0,0,1}, {0,0,-1} };
+  int volume = hm.MAX_length;
+  int pathEnd = path ? strlen( path ) : 0;
+  struct censusStep_t steps[volume];
+  steps[0].dir = -1;
+  steps[0].next = 0;
+  for (;;)
   {
-    if ( globalArgs.verbose )
-      fprintf(stderr, "      Check bounding box ");
-    switch (dir)
+    struct censusStep_t *s = &steps[ hm.length ];
+    if ( s->next == 6 )
     {
-    case 'X':
-      if( ( hm.coord[hm.length].x + elementLength ) - hm.min.x > globalArgs.boundingBox - 1 )
-      {
-        if ( globalArgs.verbose ) fprintf(stderr, " [ FAIL ]\n");
-        return;
-      }
-      break;
-    case 'x':
-      if( hm.max.x - ( hm.coord[hm.length].x - elementLength ) > globalArgs.boundingBox - 1 )
-      {
-        if ( globalArgs.verbose ) fprintf(stderr, " [ FAIL ]\n");
-        return;
-      }
-      break;
-    case 'Y':
-      if( ( hm.coord[hm.length].y + elementLength ) - hm.min.y > globalArgs.boundingBox - 1 )
-      {
-        if ( globalArgs.verbose ) fprintf(stderr, " [ FAIL ]\n");
-        return;
-      }
-      break;
-    case 'y':
-      if( hm.max.y - ( hm.coord[hm.length].y - elementLength ) > globalArgs.boundingBox - 1 )
-      {
-        if ( globalArgs.verbose ) fprintf(stderr, " [ FAIL ]\n");
-        return;
-      }
-      break;
-    case 'Z':
-      if( ( hm.coord[hm.length].z + elementLength ) - hm.min.z > globalArgs.boundingBox - 1 )
-      {
-        if ( globalArgs.verbose ) fprintf(stderr, " [ FAIL ]\n");
-        return;
-      }
-      break;
-    case 'z':
-      if( hm.max.z - ( hm.coord[hm.length].z - elementLength ) > globalArgs.boundingBox - 1 )
-      {
-        if ( globalArgs.verbose ) fprintf(stderr, " [ FAIL ]\n");
-        return;
-      }
-      break;
-    default:
-      if ( globalArgs.verbose ) fprintf(stderr, "Direction '%d' unknown\n", dir);
-      exit(EXIT_FAILURE);
+      if ( ! hm.length )
+        break;
+      censusBack( steps, side );
+      continue;
     }
-    if ( globalArgs.verbose ) fprintf(stderr, " [ SUCCESS ]\n");
-  }
+    int dir = s->next++;
+    if ( hm.length < pathEnd )
+    {
+      if ( dirChar[dir] != path[ hm.length ] )
+        continue;
+    }
+    else if ( ( ! hm.length && dir ) || ( hm.min.y == hm.max.y && dir != 0 && dir != 2 )
+              || ( dir == 5 && ! walked_in_z() && ! globalArgs.specular ) )
+      continue;
+    if ( searchStopped )
+      return;
 
-  /* Check that the new node's coordinates wouldn't overlap */
-  if ( globalArgs.verbose ) fprintf(stderr, "      Check overlap ");
-  int candidates = 0;
-  int seg = 0;
-  int i = 0;
-  for( seg = 0; seg < hm.last_element - 1; seg++ )
-    candidates += Sequence[seg] - 1;
-  while ( candidates-- )
-    for ( i = 1; i <= elementLength; i++ )
+    struct coordinates_t c = hm.coord[ hm.length ];
+    c.x += d[dir][0];
+    c.y += d[dir][1];
+    c.z += d[dir][2];
+    struct coordinates_t min = hm.min, max = hm.max;
+    min.x > c.x ? min.x = c.x : 0;
+    min.y > c.y ? min.y = c.y : 0;
+    min.z > c.z ? min.z = c.z : 0;
+    max.x < c.x ? max.x = c.x : 0;
+    max.y < c.y ? max.y = c.y : 0;
+    max.z < c.z ? max.z = c.z : 0;
+    int sx = max.x - min.x, sy = max.y - min.y, sz = max.z - min.z, u;
+    if ( sx > sy ) u = sx, sx = sy, sy = u;
+    if ( sy > sz ) u = sy, sy = sz, sz = u;
+    if ( sx > sy ) u = sx, sx = sy, sy = u;
+    if ( sx > hm.dims[0] - 1 || sy > hm.dims[1] - 1 || sz > hm.dims[2] - 1 )
+      continue;
+    int b = cellBit( c.x, c.y, c.z, side );
+    if ( hm.occupied[ b >> 6 ] & ( 1ULL << ( b & 63 ) ) )
+      continue;
+
+    /* Walks the cell, in the element of the last one if it goes on straight */
+    struct censusStep_t *next = &steps[ hm.length + 1 ];
+    next->min = hm.min;
+    next->max = hm.max;
+    next->dir = dir;
+    next->next = 0;
+    hm.min = min;
+    hm.max = max;
+    hm.coord[ ++hm.length ] = c;
+    hm.occupied[ b >> 6 ] |= 1ULL << ( b & 63 );
+    if ( dir == s->dir )
+      hm.seq[ hm.last_element ]++;
+    else
+    {
+      hm.seq[ ++hm.last_element ] = 2;
+      hm.dirs[ hm.last_element ] = dirChar[dir];
+    }
+    if ( hm.length > pathEnd )
+      hm.nodes++;
+
+    if ( hm.length == volume - 1 )
+    {
+      censusPath( t );
+      censusBack( steps, side );
+      continue;
+    }
+    if ( hm.prune )
     {
-      switch (dir)
+      int rule = pruneRule( side );
+      if ( rule >= 0 )
       {
-      case 'X':
-        if ( hm.coord[candidates].x == hm.coord[hm.length].x+i && hm.coord[candidates].y == hm.coord[hm.length].y && hm.coord[candidates].z == hm.coord[hm.length].z )
-        {
-          if ( globalArgs.verbose ) fprintf(stderr, "[ FAIL ]\n");
-          return;
-        }
-        break;
-      case 'x':
-        if ( hm.coord[candidates].x == hm.coord[hm.length].x-i && hm.coord[candidates].y == hm.coord[hm.length].y && hm.coord[candidates].z == hm.coord[hm.length].z )
-        {
-          if ( globalArgs.verbose ) fprintf(stderr, "[ FAIL ]\n");
-          return;
-        }
-        break;
-      case 'Y':
-        if ( hm.coord[candidates].x == hm.coord[hm.length].x && hm.coord[candidates].y == hm.coord[hm.length].y+i && hm.coord[candidates].z == hm.coord[hm.length].z )
-        {
-          if ( globalArgs.verbose ) fprintf(stderr, "[ FAIL ]\n");
-          return;
-        }
-        break;
-      case 'y':
-        if ( hm.coord[candidates].x == hm.coord[hm.length].x && hm.coord[candidates].y == hm.coord[hm.length].y-i && hm.coord[candidates].z == hm.coord[hm.length].z )
-        {
-          if ( globalArgs.verbose ) fprintf(stderr, "[ FAIL ]\n");
-          return;
-        }
-        break;
-      case 'Z':
-        if ( hm.coord[candidates].x == hm.coord[hm.length].x && hm.coord[candidates].y == hm.coord[hm.length].y && hm.coord[candidates].z == hm.coord[hm.length].z+i )
-        {
-          if ( globalArgs.verbose ) fprintf(stderr, "[ FAIL ]\n");
-          return;
-        }
-        break;
-      case 'z':
-        if ( hm.coord[candidates].x == hm.coord[hm.length].x && hm.coord[candidates].y == hm.coord[hm.length].y && hm.coord[candidates].z == hm.coord[hm.length].z-i )
-        {
-          if ( globalArgs.verbose ) fprintf(stderr, "[ FAIL ]\n");
-          return;
-        }
-        break;
-      default:
-        fprintf(stderr, "Direction '%c' not known\n", dir);
-        exit(EXIT_FAILURE);
+        hm.cuts[rule]++;
+        censusBack( steps, side );
+        continue;
       }
     }
+    if ( cut && hm.last_element == cut && hm.seq[ hm.last_element ] == 2 )
+    {
+      censusTask( steps );
+      censusBack( steps, side );
+    }
+  }
+}
 
-  if ( globalArgs.verbose ) fprintf(stderr, " [ SUCCESS ]\n");
+static void censusFromRoot(struct censusTable_t *t, const char *path, int cut)
+{
+#ifndef CUBE_GENERIC
+  switch ( hm.side )
+  {
+    case 3: censusWalk( t, path, cut, 3 ); return;
+    case 4: censusWalk( t, path, cut, 4 ); return;
+    case 5: censusWalk( t, path, cut, 5 ); return;
+    case 6: censusWalk( t, path, cut, 6 ); return;
+  }
+#endif
+  censusWalk( t, path, cut, hm.side );
+}
 
-  /* Update the hm structure with the new coordinates */
-  if ( globalArgs.verbose ) fprintf(stderr, "     -----> UPDATE HM\n");
+/* Walk of the census in hm, on the first cell of the box of -b */
+static void initCensusWalk()
+{
+  int *box = globalArgs.boundingBox;
+  int volume = box[0] * box[1] * box[2];
+  memcpy( hm.dims, box, sizeof(hm.dims) );
+  hm.box = box[2];
+  hm.cubic = box[0] == box[2];
+  hm.MAX_length = volume;
+  hm.seq = malloc( sizeof(int) * volume );
+  hm.coord = calloc( volume, sizeof(struct coordinates_t) );
+  hm.dirs = malloc( volume );
+  if ( ! hm.seq || ! hm.coord || ! hm.dirs )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  hm.stack = NULL;
+  hm.depth = NULL;
+  hm.table = NULL;
+  hm.memo = 0;
+  hm.nbElements = 0;
+  hm.last_element = -1;
+  hm.length = 0;
+  hm.min.x = hm.min.y = hm.min.z = 0;
+  hm.max = hm.min;
+  hm.solutions = 0;
+  hm.nodes = 0;
+  hm.firstSolution = -1;
+  hm.started = search.started;
+  memset( hm.orbits, 0, sizeof(hm.orbits) );
+  initGrid();
+  hm.occupied[0] = 1;
+}
 
-  int from = hm.length + 1;
-  int to =   hm.length + elementLength;
-  int prv_max[] ={hm.max.x, hm.max.y, hm.max.z};
-  int prv_min[] ={hm.min.x, hm.min.y, hm.min.z};
-  hm.length += elementLength;
-  for ( i = from; i <= to; i++ )
+/* Adds the counts of the walk in hm to the ones of the census */
+static void censusDone()
+{
+  int i;
+  pthread_mutex_lock( &search.streamLock );
+  search.written += hm.solutions;
+  for ( i = 1; i <= 48; i++ )
+    search.orbits[i] += hm.orbits[i];
+  for ( i = 0; i < NB_PRUNE_RULES; i++ )
+    search.cuts[i] += hm.cuts[i];
+  if ( hm.firstSolution >= 0 && ( search.firstSolution < 0 || hm.firstSolution < search.firstSolution ) )
+    search.firstSolution = hm.firstSolution;
+  pthread_mutex_unlock( &search.streamLock );
+  free( hm.seq );
+  destroy_hm();
+}
+
+static void *censusThread(void *arg)
+{
+  int id = (int) (intptr_t) arg;
+  int n;
+  initCensusWalk();
+  registerWalk( id, &hm );
+  while ( ( n = takeTask( id ) ) >= 0 )
   {
-    hm.coord[i].x = hm.coord[i-1].x;
-    hm.coord[i].y = hm.coord[i-1].y;
-    hm.coord[i].z = hm.coord[i-1].z;
+    censusFromRoot( &census.tables[id], search.tasks[n].path, 0 );
+    free( search.tasks[n].path );
+    pthread_mutex_lock( &progress.lock );
+    search.nodes += hm.nodes;
+    search.finished++;
+    hm.nodes = 0;
+    pthread_mutex_unlock( &progress.lock );
   }
+  registerWalk( id, NULL );
+  censusDone();
+  return NULL;
+}
 
-  switch (dir)
+static int compareCensus(const void *a, const void *b)
+{
+  const struct censusEntry_t *x = a, *y = b;
+  int n = x->nbElements < y->nbElements ? x->nbElements : y->nbElements;
+  int cmp = memcmp( x->seq, y->seq, n );
+  return cmp ? cmp : x->nbElements - y->nbElements;
+}
+
+void censusSearch()
+{
+  long i, j;
+  pthread_mutex_init( &search.streamLock, NULL );
+  clock_gettime( CLOCK_MONOTONIC, &search.started );
+  search.firstSolution = -1;
+  census.tables = calloc( globalArgs.threads, sizeof(struct censusTable_t) );
+  if ( ! census.tables )
   {
-  case 'X':
-    for ( i = from; i <= to; i++ )
-      hm.coord[i].x = hm.coord[i-1].x + 1;
-    hm.max.x < hm.coord[hm.length].x ? hm.max.x = hm.coord[hm.length].x : 0;
-    break;
-  case 'x':
-    for ( i = from; i <= to; i++ )
-      hm.coord[i].x = hm.coord[i-1].x - 1;
-    hm.min.x > hm.coord[hm.length].x ? hm.min.x = hm.coord[hm.length].x : 0;
-    break;
-  case 'Y':
-    for ( i = from; i <= to; i++ )
-      hm.coord[i].y = hm.coord[i-1].y + 1;
-    hm.max.y < hm.coord[hm.length].y ? hm.max.y = hm.coord[hm.length].y : 0;
-    break;
-  case 'y':
-    for ( i = from; i <= to; i++ )
-      hm.coord[i].y = hm.coord[i-1].y - 1;
-    hm.min.y > hm.coord[hm.length].y ? hm.min.y = hm.coord[hm.length].y : 0;
-    break;
-  case 'Z':
-    for ( i = from; i <= to; i++ )
-      hm.coord[i].z = hm.coord[i-1].z + 1;
-    hm.max.z < hm.coord[hm.length].z ? hm.max.z = hm.coord[hm.length].z : 0;
-    break;
-  case 'z':
-    for ( i = from; i <= to; i++ )
-      hm.coord[i].z = hm.coord[i-1].z - 1;
-    hm.min.z > hm.coord[hm.length].z ? hm.min.z = hm.coord[hm.length].z : 0;
-    break;
-  default:
-    fprintf(stderr, "Direction '%d' unknown\n", dir);
+    fprintf(stderr, "ERROR: out of memory\n");
     exit(EXIT_FAILURE);
   }
 
-  int prv_dir = hm.last_direction;
-  hm.last_direction = dir;
-  hm.last_element++;
+  /* The paths that end before the cut are counted here */
+  initCensusWalk();
+  censusFromRoot( &census.tables[0], NULL, globalArgs.splitDepth );
+  search.nodes = hm.nodes;
+  censusDone();
+  if ( globalArgs.verbose )
+    fprintf(stderr, "%d tasks for %d threads\n", search.nbTasks, globalArgs.threads);
+  runTasks( censusThread );
+  pthread_mutex_destroy( &search.streamLock );
+  free( search.tasks );
 
-  if ( globalArgs.energyFileName )
+  struct censusTable_t *all = &census.tables[0];
+  for ( i = 0; i < globalArgs.threads; i++ )
+    census.paths += census.tables[i].paths;
+  for ( i = 1; i < globalArgs.threads; i++ )
   {
-    fprintf(globalArgs.energyFile, "%d,%d\n", countContacts(), hm.length);
+    struct censusTable_t *t = &census.tables[i];
+    for ( j = 0; j < t->size; j++ )
+      if ( t->entries[j].seq )
+      {
+        censusAdd( all, t->entries[j].seq, t->entries[j].nbElements, t->entries[j].folds );
+        free( t->entries[j].seq );
+      }
+    free( t->entries );
   }
 
-  /* Check if the end of the sequence has been reached */
-  if (hm.last_element == sizeof (Sequence) / sizeof (int) - 1)
+  /* Written in the order of the sequences */
+  for ( i = j = 0; i < all->size; i++ )
+    if ( all->entries[i].seq )
+      all->entries[j++] = all->entries[i];
+  census.sequences = j;
+  qsort( all->entries, j, sizeof(struct censusEntry_t), compareCensus );
+  for ( i = 0; i < census.sequences; i++ )
   {
-    if ( globalArgs.verbose )
-    {
-      fprintf(stderr, "------------ Solution found ------------\n");
-      print_hm();
-      fprintf(stderr, "----------------------------------------\n");
-    }
-    hm.solutions++;
-
+    struct censusEntry_t *e = &all->entries[i];
+    census.unique += e->folds == 1;
     if ( globalArgs.output )
     {
-      if ( globalArgs.outFileName )
-      {
-        char fname[256] = "";
-        strcat(fname, globalArgs.outFileName);
-        strcat(fname, ".");
-        char strnumber[5];
-        sprintf(strnumber, "%04d", hm.solutions);
-        strcat(fname, strnumber);
-
-        globalArgs.outFile = fopen(fname, "w");
-        if ( ! globalArgs.outFile )
-        {
-          fprintf(stderr, "Could not open %s for writing\n", fname);
-          exit(EXIT_FAILURE);
-        }
-      }
-      
-      printCSV(Sequence, globalArgs.outFile);
-      
-      if ( globalArgs.outFileName )
-        fclose(globalArgs.outFile);
-      
+      for ( j = 0; j < e->nbElements; j++ )
+        fprintf( globalArgs.outFile, j ? ",%d" : "%d", e->seq[j] );
+      fprintf( globalArgs.outFile, " %ld\n", e->folds );
     }
-    
-    hm.length -= elementLength;
-    hm.last_direction = prv_dir;
-    hm.last_element--;
-    hm.max.x = prv_max[0];
-    hm.max.y = prv_max[1];
-    hm.max.z = prv_max[2];
-    hm.min.x = prv_min[0];
-    hm.min.y = prv_min[1];
-    hm.min.z = prv_min[2];
-
-    if ( globalArgs.newickFile )
-      fprintf( globalArgs.newickFile, "S" );
-    
-    return;
+    free( e->seq );
   }
+  free( all->entries );
+  free( census.tables );
+}
 
-  if ( globalArgs.maxSolutions && globalArgs.maxSolutions == hm.solutions )
-    return;
-
-  /* The children pointers are created depending on the direction of this
-   * present node
-   *   (x) -> (y/z)
-   *   (y) -> (x/z)
-   *   (z) -> (x/y)
-   */
-
-  if ( globalArgs.newickFile )
-    fprintf( globalArgs.newickFile, "(" );
-
-  switch(dir)
+void walkDirections()
+{
+  int i, j;
+  int k = 0;
+  hm.coord[0].x = hm.coord[0].y = hm.coord[0].z = 0;
+  for ( i = 0; i < hm.nbElements; i++ )
   {
-  case 'X':
-  case 'x':
-    createNode('Y');
-    if ( globalArgs.newickFile ){
-      fprintf( globalArgs.newickFile, "+y:%.3f,", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-    }
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    createNode('y');
-    if ( globalArgs.newickFile )
-      fprintf( globalArgs.newickFile, "-y:%.3f,", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    createNode('Z');
-    if ( globalArgs.newickFile )
-    {
-      fprintf( globalArgs.newickFile, "+z:%.3f", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-      if ( walked_in_z() || globalArgs.specular )
-        fprintf( globalArgs.newickFile, "," );
-    }
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    if ( walked_in_z() || globalArgs.specular )
-    {
-      createNode('z');
-      if ( globalArgs.newickFile )
-        fprintf( globalArgs.newickFile, "-z:%.3f", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-    }
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    break;
-  case 'Y':
-  case 'y':
-    createNode('X');
-    if ( globalArgs.newickFile )
-      fprintf( globalArgs.newickFile, "+x:%.3f,", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    createNode('x');
-    if ( globalArgs.newickFile )
-      fprintf( globalArgs.newickFile, "-x:%.3f,", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    createNode('Z');
-    if ( globalArgs.newickFile )
-    {
-      fprintf( globalArgs.newickFile, "+z:%.3f", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-      if ( walked_in_z() || globalArgs.specular )
-        fprintf( globalArgs.newickFile, "," );
-    }
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    if ( walked_in_z() || globalArgs.specular )
-    {
-      createNode('z');
-      if ( globalArgs.newickFile )
-        fprintf( globalArgs.newickFile, "-z:%.3f", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
+    int d = strchr( dirChar, hm.dirs[i] ) - dirChar;
+    int step = d & 1 ? -1 : 1;
+    for ( j = 1; j < hm.seq[i]; j++, k++ )
+    {
+      hm.coord[k+1] = hm.coord[k];
+      if ( d >> 1 == 0 )
+        hm.coord[k+1].x += step;
+      else if ( d >> 1 == 1 )
+        hm.coord[k+1].y += step;
+      else
+        hm.coord[k+1].z += step;
     }
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    break;
-  case 'Z':
-  case 'z':
-    createNode('X');
-    if ( globalArgs.newickFile )
-      fprintf( globalArgs.newickFile, "+x:%.3f,", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    createNode('x');
-    if ( globalArgs.newickFile )
-      fprintf( globalArgs.newickFile, "-x:%.3f,", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    createNode('Y');
-    if ( globalArgs.newickFile )
-      fprintf( globalArgs.newickFile, "+y:%.3f,", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    createNode('y');
-    if ( globalArgs.verbose ) fprintf(stderr, "<<<< Fallen through a node\n");
-    if ( globalArgs.newickFile )
-      fprintf( globalArgs.newickFile, "-y:%.3f", (float) Sequence[ (hm.last_element)+1 ] / hm.MAX_length );
-    break;
-  default:
-    fprintf(stderr, "Direction '%d' unknown\n", dir);
-    exit(EXIT_FAILURE);
   }
-
-  if ( globalArgs.newickFile )
-    fprintf( globalArgs.newickFile, ")" );
-
-  hm.length -= elementLength;
-  hm.last_direction = prv_dir;
-  hm.last_element--;
-  hm.max.x = prv_max[0];
-  hm.max.y = prv_max[1];
-  hm.max.z = prv_max[2];
-  hm.min.x = prv_min[0];
-  hm.min.y = prv_min[1];
-  hm.min.z = prv_min[2];
-
-  return;
+  hm.length = k;
 }
 
 void printCSV (int seq[], FILE * fh)
@@ -683,11 +4221,11 @@ int countContacts()
 {
   int i, j;
   int contacts = 0;
-  for ( i = 0; i < hm.length; i++ )
+  for ( i = 0; i <= hm.length; i++ )
   {
-    for ( j = i+3; j < hm.length; j++ )
+    for ( j = i+3; j <= hm.length; j++ )
     {
-      if ( abs(hm.coord[i].x - hm.coord[j].x) + abs(hm.coord[i].y - hm.coord[j].y) +abs(hm.coord[i].x - hm.coord[j].x) == 1 )
+      if ( abs(hm.coord[i].x - hm.coord[j].x) + abs(hm.coord[i].y - hm.coord[j].y) + abs(hm.coord[i].z - hm.coord[j].z) == 1 )
         contacts++;
     }
   }
@@ -702,28 +4240,317 @@ int is_perfect_cube(int n)
   return  n == root * root * root;
 }
 
+/*
+ * Symmetry breaking.
+ * A symmetry of the cube is fixed by where it sends the directions of the
+ * first two elements, and by whether it flips the third axis. The search
+ * walks the first element in X and the second in Y, and the first step in
+ * Z only in +Z (unless -s), so it finds every solution once for the whole
+ * group and never walks its 47 copies. Only a sequence that reads the same
+ * from both ends finds a fold twice, once from each end; the copy whose
+ * directions come later is dropped when it is found.
+ */
+
+void init_symmetries()
+{
+  static const int perms[6][3] = { {0,1,2}, {0,2,1}, {1,0,2}, {1,2,0}, {2,0,1}, {2,1,0} };
+  static const int parity[6] = { 0, 1, 1, 0, 0, 1 };
+  int p, f, a;
+  nbSymmetries = 0;
+  for ( p = 0; p < 6; p++ )
+    for ( f = 0; f < 8; f++ )
+    {
+      int flips = ( f & 1 ) + ( ( f >> 1 ) & 1 ) + ( ( f >> 2 ) & 1 );
+      // Reflections reverse the handedness, only rotations with -s
+      if ( globalArgs.specular && ( parity[p] + flips ) % 2 )
+        continue;
+      for ( a = 0; a < 3; a++ )
+      {
+        symmetry[nbSymmetries][2*a] = 2 * perms[p][a] + ( ( f >> a ) & 1 );
+        symmetry[nbSymmetries][2*a+1] = symmetry[nbSymmetries][2*a] ^ 1;
+      }
+      nbSymmetries++;
+    }
+}
+
+int solutionOrbit()
+{
+  int n = hm.nbElements;
+  int d[n], r[n];
+  int g, i;
+  for ( i = 0; i < n; i++ )
+    d[i] = strchr( dirChar, hm.dirs[i] ) - dirChar;
+  // The same fold walked from the other end
+  for ( i = 0; i < n; i++ )
+    r[i] = d[ n - 1 - i ] ^ 1;
+
+  int stabilizer = 0;
+  for ( g = 0; g < nbSymmetries; g++ )
+  {
+    int *m = symmetry[g];
+    int same = 1;
+    for ( i = 0; i < n && same; i++ )
+      same = m[ d[i] ] == d[i];
+    stabilizer += same;
+    if ( ! hm.reversible )
+      continue;
+    /* Compare the copy of the reversed walk that starts in X, Y with this
+     * walk; the first difference tells which one is kept */
+    int cmp = 0;
+    for ( i = 0; i < n && ! cmp; i++ )
+      cmp = m[ r[i] ] - d[i];
+    if ( m[ r[0] ] == 0 && m[ r[1] ] == 2 && cmp < 0 )
+      return 0;
+    stabilizer += ! cmp;
+  }
+  return nbSymmetries / stabilizer;
+}
+
 int walked_in_z()
 {
   return abs( hm.max.z - hm.min.z );
 }
 
+/*
+ * Report of the run (-J).
+ * One JSON object per line, appended to the file, so the runs of a
+ * benchmark add up to a single file. The CPU time is the one of the whole
+ * process (all the threads) and nodes_per_sec is worked out from it, with
+ * the nodes of this run only on a resumed one; the wall time runs from the
+ * start of the program. A resumed run is named after its checkpoint. The first solution is timed
+ * on the wall clock from the start of the search, and averaged over the
+ * sequences that have one in batch mode. The peak memory is the resident
+ * set size.
+ */
+
+void writeReport(const char *input, int sequences, long solutions, long nodes,
+                 double firstSolution, int unsolved, clock_t start)
+{
+  double cpu = (double) ( clock() - start ) / CLOCKS_PER_SEC;
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  double wall = ( now.tv_sec - wallStart.tv_sec ) + ( now.tv_nsec - wallStart.tv_nsec ) / 1e9;
+  char pruning[ NB_PRUNE_RULES + 1 ];
+  int i, n = 0;
+  for ( i = 0; i < NB_PRUNE_RULES; i++ )
+    if ( globalArgs.pruning & ( 1 << i ) )
+      pruning[ n++ ] = pruneChar[i];
+  pruning[n] = 0;
+  char box[40];
+  int *b = globalArgs.boundingBox;
+  if ( b[0] == -1 )
+    strcpy( box, "cube" );
+  else
+    sprintf( box, "%dx%dx%d", b[0], b[1], b[2] );
+  struct rusage usage;
+  getrusage( RUSAGE_SELF, &usage );
+  FILE *f = fopen( globalArgs.reportFileName, "a" );
+  if ( ! f )
+  {
+    fprintf(stderr, "Could not open %s to write\n", globalArgs.reportFileName);
+    exit(EXIT_FAILURE);
+  }
+  fprintf( f, "{\"input\": \"" );
+  for ( ; *input; input++ )
+    fprintf( f, *input == '"' || *input == '\\' ? "\\%c" : "%c", *input );
+  fprintf( f, "\", \"engine\": \"%s\", \"threads\": %d, \"box\": \"%s\", \"pruning\": \"%s\", "
+              "\"sequences\": %d, \"unsolved\": %d, \"solutions\": %ld, \"nodes\": %ld, "
+              "\"cpu_secs\": %.3f, \"wall_secs\": %.3f, \"nodes_per_sec\": %.0f, \"first_solution_secs\": %.6f, "
+              "\"peak_rss_kb\": %ld}\n",
+           globalArgs.exactCover ? "dlx" : "dfs", globalArgs.threads, box,
+           pruning, sequences, unsolved, solutions, nodes, cpu, wall,
+           cpu > 0 ? ( nodes - checkpoint.nodes ) / cpu : 0, firstSolution, usage.ru_maxrss );
+  if ( fclose( f ) )
+  {
+    fprintf(stderr, "Could not write %s\n", globalArgs.reportFileName);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Progress report (-P).
+ * The search threads only count: the nodes and rejected directions of each
+ * element in their walk, as they would anyway. Every -P seconds a timer
+ * thread adds up the nodes of all the walks and prints them with the rate
+ * since its last report and an estimate of how much of the search is done.
+ * The counters are read without stopping the search, so a report can be
+ * off by the nodes of a node or two, never more.
+ * With one walk the estimate is its position in the tree: the children of
+ * a node are taken as equal shares of it, and the shares of the children
+ * already searched are added up along the stack. It is rough for uneven
+ * trees but costs nothing. In parallel and batch mode it is the share of
+ * the tasks or sequences finished.
+ */
+
+/* Share of the tree left behind the walk w */
+static double treeFraction(struct HamiltonianWalk_t *w)
+{
+  double done = 0, share = 1;
+  int e;
+  for ( e = 1; e <= w->last_element; e++ )
+  {
+    struct frame_t *f = &w->stack[ e - 1 ];
+    int nb = f->nbChildren, next = f->next;
+    if ( nb < 1 || nb > 4 || next < 1 || next > nb )
+      break;
+    done += share * ( next - 1 ) / nb;
+    share /= nb;
+  }
+  return done;
+}
+
+static void *progressThread(void *arg)
+{
+  struct timespec deadline;
+  long lastNodes = checkpoint.nodes;
+  double lastTime = 0;
+  int i;
+  (void) arg;
+  clock_gettime( CLOCK_REALTIME, &deadline );
+  pthread_mutex_lock( &progress.lock );
+  while ( ! progress.stopped )
+  {
+    long step = globalArgs.progressInterval * 1e9;
+    deadline.tv_sec += ( deadline.tv_nsec + step ) / 1000000000;
+    deadline.tv_nsec = ( deadline.tv_nsec + step ) % 1000000000;
+    while ( ! progress.stopped
+            && pthread_cond_timedwait( &progress.wake, &progress.lock, &deadline ) != ETIMEDOUT )
+      ;
+    if ( progress.stopped )
+      break;
+
+    long nodes = 0;
+    double done;
+    if ( nbSequences > 1 )
+    {
+      nodes = batch.nodes;
+      done = (double) batch.finished / nbSequences;
+    }
+    else if ( progress.nbWalkers > 1 || globalArgs.census || globalArgs.checkpointFileName
+              || globalArgs.resumeFileName )
+    {
+      nodes = search.nodes;
+      done = search.nbTasks ? (double) search.finished / search.nbTasks : 0;
+    }
+    else if ( globalArgs.probes )
+      done = (double) probesDone / globalArgs.probes;
+    else
+      done = progress.walkers[0] && ! globalArgs.exactCover ? treeFraction( progress.walkers[0] ) : -1;
+    for ( i = 0; i < progress.nbWalkers; i++ )
+      if ( progress.walkers[i] )
+        nodes += progress.walkers[i]->nodes;
+
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    double time = ( now.tv_sec - wallStart.tv_sec ) + ( now.tv_nsec - wallStart.tv_nsec ) / 1e9;
+    fprintf(stderr, "Progress: %.1f secs, %ld nodes, %.0f nodes/sec", time, nodes,
+            ( nodes - lastNodes ) / ( time - lastTime ));
+    if ( done >= 0 )
+      fprintf(stderr, ", %.1f%% done", 100 * done);
+    fprintf(stderr, "\n");
+    lastNodes = nodes;
+    lastTime = time;
+  }
+  pthread_mutex_unlock( &progress.lock );
+  return NULL;
+}
+
+void startProgress(int nbWalkers)
+{
+  progress.nbWalkers = nbWalkers;
+  progress.walkers = calloc( nbWalkers, sizeof(struct HamiltonianWalk_t *) );
+  if ( ! progress.walkers )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init( &progress.lock, NULL );
+  if ( ! globalArgs.progressInterval )
+    return;
+  pthread_cond_init( &progress.wake, NULL );
+  if ( pthread_create( &progress.timer, NULL, progressThread, NULL ) )
+  {
+    fprintf(stderr, "Could not start the progress thread\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void stopProgress()
+{
+  if ( globalArgs.progressInterval )
+  {
+    pthread_mutex_lock( &progress.lock );
+    progress.stopped = 1;
+    pthread_cond_signal( &progress.wake );
+    pthread_mutex_unlock( &progress.lock );
+    pthread_join( progress.timer, NULL );
+    pthread_cond_destroy( &progress.wake );
+  }
+  pthread_mutex_destroy( &progress.lock );
+  free( progress.walkers );
+  progress.walkers = NULL;
+}
+
+void registerWalk(int id, struct HamiltonianWalk_t *w)
+{
+  pthread_mutex_lock( &progress.lock );
+  progress.walkers[id] = w;
+  pthread_mutex_unlock( &progress.lock );
+}
+
 void usage(char* pname)
 {
-    fprintf(stderr, "%s -i <file.pgn> [OPTIONS]\n", pname);
-    fprintf(stderr, "  -s       PGN input file to parse\n"
-                    "  -v       Prints heaps of useless stuff. Mainly for debugging\n"
-                    "  -h       Prints (this) help message\n");
+    fprintf(stderr, "%s [-S <sequence> | -i <file> | -G -b <box>] [OPTIONS]\n", pname);
+    fprintf(stderr, "  -S <seq>  Lengths of the elements, as in 3,3,2,2,3 (the snake cube by default)\n"
+                    "  -i <file> Sequences to solve, one per line. With more than one, prints\n"
+                    "            a line per sequence: sequence solutions nodes seconds\n"
+                    "  -c        Only counts the solutions\n"
+                    "  -s        Also gives the mirror images of the solutions\n"
+                    "  -b <box>  Side of the bounding box, or its sides as in 2x3x4 (0 for none)\n"
+                    "  -M <n>    Stops after n solutions\n"
+                    "  -o <file> Writes the solutions to a compact stream\n"
+                    "  -D <file> Prints the solutions of a stream as CSV\n"
+                    "  -E <file> Writes the nodes by length and contacts, and the solutions by\n"
+                    "            contacts, as a CSV matrix\n"
+                    "  -n <file> Writes the search tree in Newick format\n"
+                    "  -L <n>    Stops the Newick tree n elements past the first two\n"
+                    "  -p <pdr>  Cuts the walks that cannot fill the box: p by parity,\n"
+                    "            d with dead cells, r with cells out of reach\n"
+                    "  -m <MB>   With -c, counts through a table of the subtrees of this size\n"
+                    "  -R <pol>  Replacement in the table: two (default), always or depth\n"
+                    "  -T <n>    Uses the table only while n elements or more are left (default 28)\n"
+                    "  -e <eng>  Solver: dfs (default) or dlx, exact cover with dancing links\n"
+                    "  -j <n>    Search threads\n"
+                    "  -d <n>    Elements walked before the tree is split between threads\n"
+                    "  -B <goal> Keeps only the folds with the most (max) or fewest (min)\n"
+                    "            contacts, cutting the walks that cannot reach them\n"
+                    "  -K <n>    Number of folds kept by -B (1 by default)\n"
+                    "  -t <n>    Estimates the nodes, solutions and time of the search from n\n"
+                    "            random probes (n,seed for another seed than 1)\n"
+                    "  -G        Prints the sequences that fold into the box of -b, one per line\n"
+                    "            with their number of folds\n"
+                    "  -C <file> Saves the frontier of the search to the file every 10 minutes\n"
+                    "            (file,secs for every secs seconds)\n"
+                    "  -r <file> Resumes the search saved in the checkpoint, with its sequence,\n"
+                    "            box and -s\n"
+                    "  -x <n>    Splits the checkpoint of -r into n, written to file.1 to file.n\n"
+                    "  -P <secs> Prints the progress of the search every secs seconds\n"
+                    "  -J <file> Appends a JSON summary of the run (nodes/sec, time to the\n"
+                    "            first solution, peak memory) to the file\n"
+                    "  -v        Also prints the nodes and rejected directions of each element\n"
+                    "            and the first solution found\n"
+                    "  -h        Prints (this) help message\n");
 }
 
 void print_hm ()
 {
   fprintf(stderr, "%d %d %d\n", hm.coord[0].x, hm.coord[0].y, hm.coord[0].z);
-  int tot_E = sizeof (Sequence) / sizeof (int);
+  int tot_E = hm.nbElements;
   int E;
   int i = 1;
   for( E = 0; E < tot_E; E++ )
   {
-    int E_len = Sequence[E] - 1;
+    int E_len = hm.seq[E] - 1;
     int j;
     for( j = 0; j < E_len; j++ )
     {
@@ -742,6 +4569,7 @@ void print_hm ()
   fprintf(stderr, "last_direction = %c\n", hm.last_direction);
   fprintf(stderr, "last_element = %d\n", hm.last_element);
   fprintf(stderr, "length = %d\n", hm.length);
+  fprintf(stderr, "contacts = %d\n", countContacts());
   fprintf(stderr, "min.x = %d\n", hm.min.x);
   fprintf(stderr, "min.y = %d\n", hm.min.y);
   fprintf(stderr, "min.z = %d\n", hm.min.z);
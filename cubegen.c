@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+/*
+ * Generator of solvable sequences for cube.
+ * A random Hamiltonian path of an X x Y x Z box is cut into its straight
+ * elements, so the sequence folds at least into that box. The paths come
+ * from backbite moves: a neighbour of one end of the path is taken, and the
+ * part of the path up to that neighbour is reversed, which keeps a path
+ * through all the cells. Starting from a zigzag through the box and making
+ * enough moves between two sequences gives paths of every shape.
+ * Left alone the paths turn at almost every cell, which gives puzzles of
+ * short elements with huge search trees, unlike the ones sold. A move that
+ * adds elements is only kept with probability exp(-straightness * added)
+ * (Metropolis). With the default of 1 a 4x4x4 box gives about 38 elements
+ * instead of 49, and a search of a second or so per sequence.
+ * The random numbers are our own, so a seed gives the same sequences on
+ * every machine.
+ */
+
+uint64_t rngState;
+
+/* xorshift64* */
+uint64_t nextRandom()
+{
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+int X, Y, Z, volume;
+double straightness = 1.0;
+int *path;                  /* Cells of the path, x + X * ( y + Y * z ) */
+int *position;              /* Index of each cell in the path */
+
+/* Reverses path[from..to] */
+void reversePath(int from, int to)
+{
+  for ( ; from < to; from++, to-- )
+  {
+    int c = path[from];
+    path[from] = path[to];
+    path[to] = c;
+    position[ path[from] ] = from;
+    position[ path[to] ] = to;
+  }
+}
+
+/* Number of straight elements of the path */
+int countElements()
+{
+  int i, n = 1;
+  for ( i = 2; i < volume; i++ )
+    n += path[i] - path[i-1] != path[i-1] - path[i-2];
+  return n;
+}
+
+/* One backbite move from a random end of the path, kept or taken back */
+void backbite()
+{
+  if ( nextRandom() & 1 )
+    reversePath( 0, volume - 1 );
+  int c = path[0];
+  int x = c % X, y = c / X % Y, z = c / X / Y;
+  switch ( nextRandom() % 6 )
+  {
+    case 0: x++; break;
+    case 1: x--; break;
+    case 2: y++; break;
+    case 3: y--; break;
+    case 4: z++; break;
+    default: z--;
+  }
+  if ( x < 0 || x >= X || y < 0 || y >= Y || z < 0 || z >= Z )
+    return;
+  int i = position[ x + X * ( y + Y * z ) ];
+  if ( i < 2 )
+    return;
+  int before = countElements();
+  reversePath( 0, i - 1 );
+  int added = countElements() - before;
+  if ( added > 0 && ( nextRandom() >> 11 ) * 0x1.0p-53 >= exp( - straightness * added ) )
+    reversePath( 0, i - 1 );
+}
+
+/* Lengths of the straight elements of the path, counting the joints at both
+ * ends. Returns the number of elements. */
+int pathSequence(int *seq)
+{
+  int i, n = 0;
+  int last = 0;
+  seq[0] = 1;
+  for ( i = 1; i < volume; i++ )
+  {
+    int step = path[i] - path[i-1];
+    if ( i > 1 && step != last )
+      seq[++n] = 1;
+    seq[n]++;
+    last = step;
+  }
+  return n + 1;
+}
+
+int sameSequence(int *a, int na, int *b, int nb)
+{
+  int i;
+  if ( na != nb )
+    return 0;
+  if ( ! memcmp( a, b, na * sizeof(int) ) )
+    return 1;
+  for ( i = 0; i < na; i++ )
+    if ( a[i] != b[ nb - 1 - i ] )
+      return 0;
+  return 1;
+}
+
+void usage(char* pname)
+{
+  fprintf(stderr, "%s <X> <Y> <Z> <count> <seed> [<straightness>]\n", pname);
+  fprintf(stderr, "  Prints count different sequences that fold into an X x Y x Z box,\n"
+                  "  one per line, the same ones for the same seed. The higher the\n"
+                  "  straightness (1 by default, 0 for none), the longer the elements\n");
+}
+
+int main ( int argc, char *argv[] )
+{
+  int i;
+  if ( argc != 6 && argc != 7 )
+  {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  X = atoi( argv[1] );
+  Y = atoi( argv[2] );
+  Z = atoi( argv[3] );
+  int count = atoi( argv[4] );
+  rngState = strtoull( argv[5], NULL, 0 ) * 0x9E3779B97F4A7C15ULL + 1;
+  if ( argc == 7 )
+    straightness = atof( argv[6] );
+  if ( X < 1 || Y < 1 || Z < 1 || X * Y * Z < 4 || count < 1 || straightness < 0 )
+  {
+    fprintf(stderr, "The box needs 4 or more cells, the count has to be positive "
+                    "and the straightness not negative\n");
+    exit(EXIT_FAILURE);
+  }
+  volume = X * Y * Z;
+
+  path = malloc( sizeof(int) * volume );
+  position = malloc( sizeof(int) * volume );
+  int *seq = malloc( sizeof(int) * volume );
+  int **found = malloc( sizeof(int *) * count );
+  int *foundLengths = malloc( sizeof(int) * count );
+  if ( ! path || ! position || ! seq || ! found || ! foundLengths )
+  {
+    fprintf(stderr, "ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Zigzag through the rows, the layers and the box */
+  int n = 0, y, z;
+  for ( z = 0; z < Z; z++ )
+    for ( y = 0; y < Y; y++ )
+    {
+      int row = z & 1 ? Y - 1 - y : y;
+      for ( i = 0; i < X; i++ )
+      {
+        int x = ( z * Y + y ) & 1 ? X - 1 - i : i;
+        path[n] = x + X * ( row + Y * z );
+        position[ path[n] ] = n;
+        n++;
+      }
+    }
+
+  printf("# cubegen %d %d %d %d %s %g\n", X, Y, Z, count, argv[5], straightness);
+  int nbFound = 0;
+  long tries = 0;
+  long moves = 10L * volume * volume;
+  while ( nbFound < count )
+  {
+    long m;
+    for ( m = 0; m < moves; m++ )
+      backbite();
+    int length = pathSequence( seq );
+    if ( ++tries > 1000L * count )
+    {
+      fprintf(stderr, "Only %d different sequences found for the box\n", nbFound);
+      break;
+    }
+    if ( length < 3 )
+      continue;
+    for ( i = 0; i < nbFound; i++ )
+      if ( sameSequence( seq, length, found[i], foundLengths[i] ) )
+        break;
+    if ( i < nbFound )
+      continue;
+    found[nbFound] = malloc( sizeof(int) * length );
+    if ( ! found[nbFound] )
+    {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    memcpy( found[nbFound], seq, sizeof(int) * length );
+    foundLengths[nbFound++] = length;
+    for ( i = 0; i < length; i++ )
+      printf( i ? ",%d" : "%d", seq[i] );
+    printf("\n");
+  }
+  exit(EXIT_SUCCESS);
+}